@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# cat throughput on a large file: the builtin to /dev/null, to a regular
+# file and into a pipe, reported in MB/s as one JSON object per line.
+# The data is written in $TMPDIR (default /tmp), so it needs MB megabytes
+# free there, twice over.
+#
+# usage: SHSH=./shsh bench/cat.sh [MB]
+
+SHSH=${SHSH:-./shsh}
+MB=${1:-1024}
+
+data=$(mktemp)
+copy=$(mktemp)
+trap 'rm -f "$data" "$copy"' EXIT
+dd if=/dev/zero of="$data" bs=1M count="$MB" 2> /dev/null
+
+run() {
+	start=$(date +%s%N)
+	printf '%s\n' "$2" | "$SHSH" > /dev/null
+	end=$(date +%s%N)
+	printf '{"bench":"cat","target":"%s","mb":%d,"mb_per_s":%d}\n' \
+		"$1" "$MB" $((MB * 1000000000 / (end - start)))
+}
+
+run devnull "cat $data > /dev/null"
+run file "cat $data > $copy"
+run pipe "cat $data | /bin/cat > /dev/null"
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Pipeline cost with 10 stages: setup and teardown latency of
+# "/bin/true | ... | /bin/true" run N times, and throughput of MB megabytes
+# through "cat FILE | /bin/cat | ..." (nine /bin/cat stages).  One JSON
+# object per line.
+#
+# usage: SHSH=./shsh bench/pipeline.sh [N] [MB]
+
+SHSH=${SHSH:-./shsh}
+N=${1:-500}
+MB=${2:-256}
+
+script=$(mktemp)
+data=$(mktemp)
+trap 'rm -f "$script" "$data"' EXIT
+dd if=/dev/zero of="$data" bs=1M count="$MB" 2> /dev/null
+
+true10=/bin/true
+cat10="cat $data"
+i=1
+while [ "$i" -lt 10 ]; do
+	true10="$true10 | /bin/true"
+	cat10="$cat10 | /bin/cat"
+	i=$((i + 1))
+done
+
+i=0
+while [ "$i" -lt "$N" ]; do
+	echo "$true10"
+	i=$((i + 1))
+done > "$script"
+start=$(date +%s%N)
+"$SHSH" < "$script" > /dev/null
+end=$(date +%s%N)
+printf '{"bench":"pipeline","stages":10,"n":%d,"us_per_pipeline":%d}\n' \
+	"$N" $(((end - start) / N / 1000))
+
+start=$(date +%s%N)
+echo "$cat10" | "$SHSH" > /dev/null
+end=$(date +%s%N)
+printf '{"bench":"pipeline","stages":10,"mb":%d,"mb_per_s":%d}\n' \
+	"$MB" $((MB * 1000000000 / (end - start)))
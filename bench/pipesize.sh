@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Pipeline throughput at different pipe sizes: push a file through
+# "cat FILE | /bin/cat | /bin/cat" under each "set pipesize=" and report
+# MB/s as one JSON object per line.  A size the shell refuses is reported
+# as skipped instead.
+#
+# usage: SHSH=./shsh bench/pipesize.sh [MB]
+
+SHSH=${SHSH:-./shsh}
+MB=${1:-512}
+
+data=$(mktemp)
+trap 'rm -f "$data"' EXIT
+dd if=/dev/zero of="$data" bs=1M count="$MB" 2> /dev/null
+
+for size in 0 256K 1M 4M; do
+	# Sizes over /proc/sys/fs/pipe-max-size need CAP_SYS_RESOURCE; a
+	# rejected size would only time the kernel default again.
+	err=$("$SHSH" -c "set pipesize=$size" 2>&1 > /dev/null)
+	if [ -n "$err" ]; then
+		printf '{"bench":"pipesize","pipesize":"%s","mb":%d,"skipped":"%s"}\n' \
+			"$size" "$MB" "$err"
+		continue
+	fi
+	start=$(date +%s%N)
+	printf 'set pipesize=%s\ncat %s | /bin/cat | /bin/cat\n' "$size" "$data" |
+		"$SHSH" > /dev/null
+	end=$(date +%s%N)
+	printf '{"bench":"pipesize","pipesize":"%s","mb":%d,"mb_per_s":%d}\n' \
+		"$size" "$MB" $((MB * 1000000000 / (end - start)))
+done
@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+# Run every benchmark in this directory against one shsh binary.  Each
+# prints one JSON object per result line, so the combined output can be
+# fed to a dashboard as is.  Inputs are generated deterministically, so
+# runs on the same machine are comparable.
+#
+# usage: SHSH=./shsh bench/run.sh
+
+SHSH=${SHSH:-./shsh}
+case $SHSH in
+/*) ;;
+*) SHSH=$(pwd)/$SHSH ;;
+esac
+export SHSH
+
+dir=$(dirname "$0")
+for bench in "$dir"/*.sh; do
+	[ "$(basename "$bench")" = run.sh ] && continue
+	sh "$bench" || echo "bench: $bench failed" >&2
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Sort throughput: sort the same pseudo-random file with the builtin's qsort()
+# and radix modes and with the system sort(1) under LC_ALL=C, and report
+# the wall time of each as one JSON object per line.
+#
+# usage: SHSH=./shsh bench/sort.sh [LINES]
+
+SHSH=${SHSH:-./shsh}
+LINES=${1:-2000000}
+
+data=$(mktemp)
+trap 'rm -f "$data"' EXIT
+# Fixed seed, so every run sorts the same lines.
+awk -v n="$LINES" 'BEGIN {
+	srand(575)
+	for (i = 0; i < n; i++)
+		printf "%08x%08x%04x\n", rand() * 4294967296, rand() * 4294967296, rand() * 65536
+}' > "$data"
+
+run() {
+	name=$1
+	shift
+	start=$(date +%s%N)
+	"$@" > /dev/null
+	end=$(date +%s%N)
+	printf '{"bench":"sort","impl":"%s","lines":%d,"ms":%d}\n' \
+		"$name" "$LINES" $(((end - start) / 1000000))
+}
+
+run builtin "$SHSH" -c "sort $data"
+run builtin-radix "$SHSH" -c "sort --radix $data"
+run gnu env LC_ALL=C sort "$data"
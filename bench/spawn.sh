@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Spawn latency of each launch backend: feed shsh N runs of /bin/true and
+# report the mean wall time per command as one JSON object per line.
+#
+# usage: SHSH=./shsh bench/spawn.sh [N]
+
+SHSH=${SHSH:-./shsh}
+N=${1:-2000}
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+i=0
+while [ "$i" -lt "$N" ]; do
+	echo /bin/true
+	i=$((i + 1))
+done > "$script"
+
+for backend in fork vfork posix_spawn; do
+	start=$(date +%s%N)
+	SHSH_SPAWN=$backend "$SHSH" < "$script" > /dev/null
+	end=$(date +%s%N)
+	printf '{"bench":"spawn","backend":"%s","n":%d,"ns_per_op":%d}\n' \
+		"$backend" "$N" $(((end - start) / N))
+done
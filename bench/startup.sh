@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Startup cost: time N cold starts of shsh (and of dash, when installed)
+# for each case below and report the mean per run as one JSON object per
+# line.
+#
+#   eof      exec, read an empty stdin, exit
+#   builtin  -c with a builtin ("pwd")
+#   exec     -c with an external command ("/bin/true")
+#   prompt   exec to first prompt on a pseudo-terminal (needs python3)
+#
+# usage: SHSH=./shsh bench/startup.sh [N]
+
+SHSH=${SHSH:-./shsh}
+N=${1:-1000}
+
+report() {
+	printf '{"bench":"startup","shell":"%s","case":"%s","n":%d,"us_per_run":%d}\n' \
+		"$1" "$2" "$N" "$3"
+}
+
+run() {
+	sh_name=$1
+	case_name=$2
+	shift 2
+	start=$(date +%s%N)
+	i=0
+	while [ "$i" -lt "$N" ]; do
+		"$@" < /dev/null > /dev/null 2>&1
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	report "$sh_name" "$case_name" $(((end - start) / N / 1000))
+}
+
+# Fork on a pty, exec the shell and wait for its prompt; script(1) would
+# add a quarter of a second of its own per run.
+prompt() {
+	python3 - "$1" "$N" <<'EOF'
+import os, pty, sys, time
+
+shell, n = sys.argv[1], int(sys.argv[2])
+total = 0.0
+for _ in range(n):
+    start = time.perf_counter()
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.execvp(shell, [shell])
+    out = b""
+    while not out.rstrip().endswith((b"%", b"$", b"#")):
+        out += os.read(fd, 4096)
+    total += time.perf_counter() - start
+    os.write(fd, b"exit\n")
+    os.waitpid(pid, 0)
+    os.close(fd)
+print(int(total / n * 1e6))
+EOF
+}
+
+for shell in "$SHSH" dash; do
+	command -v "$shell" > /dev/null 2>&1 || continue
+	name=$(basename "$shell")
+	run "$name" eof "$shell"
+	run "$name" builtin "$shell" -c pwd
+	run "$name" exec "$shell" -c /bin/true
+	if command -v python3 > /dev/null 2>&1; then
+		report "$name" prompt "$(prompt "$shell")"
+	fi
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Tokenizer cost: run a script of N distinct echo lines of T words each
+# (plain, quoted and escaped) with output to /dev/null, and report the
+# time per line and per token as one JSON object.  The lines differ so the
+# parse cache cannot serve them.
+#
+# usage: SHSH=./shsh bench/tokenize.sh [N] [T]
+
+SHSH=${SHSH:-./shsh}
+N=${1:-20000}
+T=${2:-32}
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+awk -v n="$N" -v t="$T" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		line = "echo " i
+		for (j = 1; j < t; j++) {
+			if (j % 4 == 1)
+				line = line " \"quoted word " j "\""
+			else if (j % 4 == 2)
+				line = line " '\''single " j "'\''"
+			else if (j % 4 == 3)
+				line = line " esc\\ aped" j
+			else
+				line = line " plain" j
+		}
+		print line
+	}
+}' > "$script"
+
+start=$(date +%s%N)
+"$SHSH" "$script" > /dev/null
+end=$(date +%s%N)
+printf '{"bench":"tokenize","lines":%d,"tokens":%d,"ns_per_line":%d,"ns_per_token":%d}\n' \
+	"$N" "$T" $(((end - start) / N)) $(((end - start) / N / T))
@@ -10,13 +10,32 @@
 
 *******************************************************************************/
 
+#define _GNU_SOURCE
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <signal.h>
+#include <stdint.h>
+#include <endian.h>
+#include <dlfcn.h>
 
 /*
   Function Declarations for builtin shell commands:
@@ -28,32 +47,228 @@ int lsh_help(char **args);
 int lsh_exit(char **args);
 int lsh_pwd(char **args);
 int lsh_sort(char **args);
+int lsh_hash(char **args);
+int lsh_set(char **args);
+int lsh_time(char **args);
+int lsh_cache_cmd(char **args);
+int lsh_jobs_cmd(char **args);
+int lsh_wait(char **args);
+int lsh_fg(char **args);
+int lsh_parallel(char **args);
+int lsh_export(char **args);
+int lsh_unset(char **args);
+int lsh_coproc_cmd(char **args);
+int lsh_enable(char **args);
+struct lsh_cmd;
+int lsh_execute(struct lsh_cmd *cmd);
 
 /*
-  List of builtin commands, followed by their corresponding functions.
+  Registry of builtin commands.  Adding a builtin only means adding its
+  declaration above and one line here.  "enable -f" appends more at run
+  time, so lookups go through lsh_builtins and lsh_nbuiltins.
 */
-char *builtin_str[] = {
-	"cd",
-	"cat",
-	"echo",
-	"help",
-	"exit",
-	"pwd",
-	"sort"
+struct lsh_builtin {
+	char *name;
+	int (*func)(char **);
 };
 
-int (*builtin_func[]) (char **) = {
-	&lsh_cd,
-	&lsh_cat,
-	&lsh_echo,
-	&lsh_help,
-	&lsh_exit,
-	&lsh_pwd,
-	&lsh_sort
+struct lsh_builtin lsh_builtin_table[] = {
+	{ "cd", &lsh_cd },
+	{ "cat", &lsh_cat },
+	{ "echo", &lsh_echo },
+	{ "help", &lsh_help },
+	{ "exit", &lsh_exit },
+	{ "pwd", &lsh_pwd },
+	{ "sort", &lsh_sort },
+	{ "hash", &lsh_hash },
+	{ "set", &lsh_set },
+	{ "time", &lsh_time },
+	{ "cache", &lsh_cache_cmd },
+	{ "jobs", &lsh_jobs_cmd },
+	{ "wait", &lsh_wait },
+	{ "fg", &lsh_fg },
+	{ "parallel", &lsh_parallel },
+	{ "export", &lsh_export },
+	{ "unset", &lsh_unset },
+	{ "coproc", &lsh_coproc_cmd },
+	{ "enable", &lsh_enable }
 };
 
-int lsh_num_builtins() {
-	return sizeof(builtin_str) / sizeof(char *);
+#define LSH_NUM_BUILTINS ((int) (sizeof(lsh_builtin_table) / sizeof(lsh_builtin_table[0])))
+
+struct lsh_builtin *lsh_builtins = lsh_builtin_table;
+int lsh_nbuiltins = LSH_NUM_BUILTINS;
+
+#define LSH_TOK_BUFSIZE 64
+
+/*
+  A command line after lexing: the words of every pipeline stage in one
+  argv, each stage NULL terminated, with the index of each stage's first
+  word.  The buffers are kept between lines and only ever grow.
+*/
+struct lsh_cmd {
+	char *text;	// word arena
+	size_t textlen;
+	size_t textcap;
+	char **argv;
+	int argc;	// words, not counting stage terminators
+	int argvcap;
+	int *stage;
+	int nstage;
+	int stagecap;
+	int background;	// ended with '&'
+};
+
+/*
+  Redirection operators.  The lexer stores these exact pointers in argv, so
+  an operator can be told from a quoted word that happens to read ">".
+  The "&" forms take a descriptor number instead of a file name.
+*/
+char lsh_op_in[] = "<";
+char lsh_op_out[] = ">";
+char lsh_op_append[] = ">>";
+char lsh_op_err[] = "2>";
+char lsh_op_dupin[] = "<&";
+char lsh_op_dupout[] = ">&";
+char lsh_op_duperr[] = "2>&";
+
+#define lsh_is_dup(w) \
+	((w) == lsh_op_dupin || (w) == lsh_op_dupout || (w) == lsh_op_duperr)
+#define lsh_is_op(w) \
+	((w) == lsh_op_in || (w) == lsh_op_out || (w) == lsh_op_append || \
+	 (w) == lsh_op_err || lsh_is_dup(w))
+
+/**
+   @brief Write a whole buffer, retrying after partial writes.
+   @param fd Descriptor to write to.
+   @param buf Data to write.
+   @param len Number of bytes.
+   @return 0 on success, -1 on error.
+*/
+int lsh_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+  Shell output buffer.  Builtins print through lsh_out_*() instead of stdio
+  or raw write(), so a command's output leaves in a few large writes and in
+  the order it was produced.  The buffer is flushed when it fills, when the
+  command is done and before anything else gets hold of descriptor 1.
+*/
+#define LSH_OUT_BUFSIZE (64 * 1024)
+
+char lsh_out_buf[LSH_OUT_BUFSIZE];
+size_t lsh_out_len;
+
+/**
+   @brief Write out everything buffered for stdout, stdio's included.
+   @return 0 on success, -1 on error.
+*/
+int lsh_out_flush(void)
+{
+	int r = 0;
+
+	fflush(stdout);
+	if (lsh_out_len > 0)
+		r = lsh_write_all(1, lsh_out_buf, lsh_out_len);
+	lsh_out_len = 0;
+	if (r < 0)
+		// EPIPE included: SIGPIPE is ignored, so a closed reader ends here.
+		fprintf(stderr, "lsh: write error: %s\n", strerror(errno));
+	return r;
+}
+
+/**
+   @brief Append bytes to the output buffer.
+   @param s Data to print.
+   @param len Number of bytes.
+   Data too big to be worth copying goes out in one writev() together with
+   what is buffered already.
+*/
+void lsh_out_write(const char *s, size_t len)
+{
+	if (len <= LSH_OUT_BUFSIZE - lsh_out_len) {
+		memcpy(lsh_out_buf + lsh_out_len, s, len);
+		lsh_out_len += len;
+		return;
+	}
+	fflush(stdout);
+	if (len < LSH_OUT_BUFSIZE / 2) {
+		lsh_out_flush();
+		memcpy(lsh_out_buf, s, len);
+		lsh_out_len = len;
+		return;
+	}
+
+	struct iovec iov[2] = {
+		{ lsh_out_buf, lsh_out_len },
+		{ (char *) s, len }
+	};
+	int i = lsh_out_len > 0 ? 0 : 1;
+	ssize_t n;
+	lsh_out_len = 0;
+	while (i < 2) {
+		n = writev(1, iov + i, 2 - i);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "lsh: write error: %s\n", strerror(errno));
+			return;
+		}
+		for (; i < 2 && (size_t) n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (i < 2) {
+			iov[i].iov_base = (char *) iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
+
+/**
+   @brief Append a string to the output buffer.
+   @param s Null terminated string.
+*/
+void lsh_out_str(const char *s)
+{
+	lsh_out_write(s, strlen(s));
+}
+
+/**
+   @brief Append one character to the output buffer.
+   @param c The character.
+*/
+void lsh_out_char(char c)
+{
+	if (lsh_out_len == LSH_OUT_BUFSIZE)
+		lsh_out_flush();
+	lsh_out_buf[lsh_out_len++] = c;
+}
+
+/**
+   @brief Append a number in decimal to the output buffer.
+   @param n The number.
+*/
+void lsh_out_uint(unsigned long n)
+{
+	char num[24], *p = num + sizeof(num);
+
+	do {
+		*--p = '0' + n % 10;
+	} while ((n /= 10) != 0);
+	lsh_out_write(p, num + sizeof(num) - p);
 }
 
 /*
@@ -67,10 +282,10 @@ int lsh_num_builtins() {
 */
 int lsh_cd(char **args)
 {
-	if (args[0] == NULL) {
+	if (args[1] == NULL) {
 		fprintf(stderr, "lsh: expected argument to \"cd\"\n");
 	} else {
-		if (chdir(args[0]) != 0) {
+		if (chdir(args[1]) != 0) {
 			perror("lsh");
 		}
 	}
@@ -86,13 +301,15 @@ int lsh_cd(char **args)
 int lsh_pwd(char **args)
 {
 	if (args[0] == NULL) {
-		printf("\n");
+		lsh_out_char('\n');
 	} else {
 		char cwd[LSH_PATHSIZE];
-		if (getcwd(cwd, sizeof(cwd)) != NULL)
-			printf("%s\n", cwd);
-		else
+		if (getcwd(cwd, sizeof(cwd)) != NULL) {
+			lsh_out_str(cwd);
+			lsh_out_char('\n');
+		} else {
 			perror("lsh");
+		}
 	}
 	return 1;
 }
@@ -106,384 +323,4307 @@ int lsh_pwd(char **args)
 int lsh_echo(char **args)
 {
 	if (args[0] == NULL) {
-		printf("\n");
+		lsh_out_char('\n');
 	} else {
 		int i = 1;
 		while (args[i] != NULL) {
-			if ( args[i][0] == '$')
-				printf("%s", getenv(args[i] + 1) );
-			else
-				printf("%s", ( args[i]));
+			// $VAR has been expanded by the lexer already.
+			lsh_out_str(args[i]);
 			if (args[i++ + 1] != NULL)
-				printf(" ");
+				lsh_out_char(' ');
 			else
-				printf("\n");
+				lsh_out_char('\n');
 		}
 	}
 	return 1;
 }
 
-/**
-   @brief Bultin command: print file
-   @param args List of args.  args[0] is "cat".  args[1] is the filename.
-   @return Always returns 1, to continue executing.
+/*
+  Lines are kept back to back in one growable arena and their users work on
+  a separate index of (offset, length) pairs into it, so reading the input
+  costs no allocation per line.
 */
-int lsh_cat(char **args) {
-	int file;
-	char buffer[256];
-	int read_size;
-	int len = 0;
+#define LSH_RL_BUFSIZE 1024
+#define LSH_ARENA_BUFSIZE (64 * 1024)
 
-	// Count number in args
-	while (args[len] != NULL)
-		len++;
+struct lsh_arena {
+	char *buf;
+	size_t used;
+	size_t cap;
+};
 
-	if (len < 2) {
-		fprintf(stderr, "Error: usage: cat filename\n");
-		return 1;
+struct lsh_line {
+	size_t off;
+	size_t len;
+	// Sort key, parsed once per line by the sort: the key field's range and
+	// its first 8 bytes big endian (or its value, with -n).
+	uint64_t key;
+	size_t koff;
+	size_t klen;
+};
+
+/**
+   @brief Make room for at least extra more bytes in an arena.
+*/
+void lsh_arena_reserve(struct lsh_arena *arena, size_t extra)
+{
+	size_t cap = arena->cap ? arena->cap : LSH_ARENA_BUFSIZE;
+
+	if (arena->used + extra <= arena->cap)
+		return;
+	while (cap < arena->used + extra)
+		cap *= 2;
+	arena->buf = realloc(arena->buf, cap);
+	if (!arena->buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
 	}
-	for (int i = 1; i < len; i++) {
-		file = open(args[i], O_RDONLY);
-		if (file == -1) {
-			fprintf(stderr, "Error: %s: file not found\n", args[i]);
-			return 1;
+	arena->cap = cap;
+}
+
+/**
+   @brief Append a line to the index, growing it as needed.
+*/
+void lsh_line_push(struct lsh_line **lines, size_t *n, size_t *cap,
+                   size_t off, size_t len)
+{
+	if (*n >= *cap) {
+		*cap = *cap ? *cap * 2 : LSH_RL_BUFSIZE;
+		*lines = realloc(*lines, *cap * sizeof(struct lsh_line));
+		if (!*lines) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
 		}
-		while((read_size = read(file, buffer, 256)) > 0)
-			write(1, &buffer, read_size);
-		close(file);
 	}
-	return 1;
+	(*lines)[*n].off = off;
+	(*lines)[*n].len = len;
+	(*lines)[*n].key = 0;
+	(*n)++;
 }
 
+/*
+  Line input shared by the builtins that read files or stdin.  A regular
+  file is mmap()ed and indexed in place; anything else is read() in large
+  blocks straight into an arena.  Either way newlines are found with
+  memchr(), which glibc implements with SSE2/AVX2 (or NEON) and which beats
+  any per-byte loop by a wide margin, and the result is one (offset, length)
+  index over a single base buffer.
+*/
+#define LSH_LINES_READSIZE (256 * 1024)
+
+struct lsh_lines {
+	struct lsh_arena arena;	// the mapping itself when mapped
+	struct lsh_line *line;
+	size_t n;
+	size_t cap;
+	size_t start;	// offset of the line still being read
+	int mapped;	// arena.buf is a file mapping of arena.cap bytes
+};
 
 /**
-   @brief Builtin command: print help.
-   @param args List of args.  Not examined.
-   @return Always returns 1, to continue executing.
+   @brief Index the complete lines in a range of the base buffer.
+   @param in Lines read so far.
+   @param from Offset to start scanning at.
+   @param to Offset to stop at.
 */
-int lsh_help(char **args)
+void lsh_lines_index(struct lsh_lines *in, size_t from, size_t to)
 {
-	int i;
-	printf("Shunsuke Haga's SHSH\n");
-	printf("the forked project from Stephen Brennan's LSH\n");
-	printf("Type program names and arguments, and hit enter.\n");
-	printf("The following are built in:\n");
+	char *p = in->arena.buf + from, *end = in->arena.buf + to, *nl;
 
-	for (i = 0; i < lsh_num_builtins(); i++) {
-		printf("  %s\n", builtin_str[i]);
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		lsh_line_push(&in->line, &in->n, &in->cap, in->start,
+		              nl - in->arena.buf - in->start);
+		in->start = nl + 1 - in->arena.buf;
+		p = nl + 1;
 	}
-
-	printf("Use the man command for information on other programs.\n");
-	return 1;
 }
 
 /**
-   @brief Builtin command: exit.
-   @param args List of args.  Not examined.
-   @return Always returns 0, to terminate execution.
+   @brief Map a regular file as the input, instead of reading it.
+   @param in Lines, not read from yet.
+   @param fd Descriptor of the input.
+   @return 0 if the file is mapped, -1 if it has to be read().
 */
-int lsh_exit(char **args)
+int lsh_lines_map(struct lsh_lines *in, int fd)
 {
+	struct stat st;
+	char *map;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    lseek(fd, 0, SEEK_CUR) != 0)
+		return -1;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	in->arena.buf = map;
+	in->arena.used = 0;
+	in->arena.cap = st.st_size;
+	in->mapped = 1;
 	return 0;
 }
 
 /**
-   @brief Bultin command: sort
-   @param args List of args.  args[0] is "sort".  args[1] is the statment.
-   @return Always returns 1, to continue executing.
+   @brief Read one block of input and index the complete lines in it.
+   @param in Lines read so far.
+   @param fd Descriptor to read from (ignored once mapped).
+   @return Bytes read, or 0 at end of input, where an unterminated last
+   line has been indexed too.
 */
-#define LSH_RL_BUFSIZE 1024
-int lsh_sort(char **args)
+size_t lsh_lines_read(struct lsh_lines *in, int fd)
 {
-	int i, j;
-	char *temp;
-	int len = 0;
-
-	if (args[1] == NULL) {
-		// If no arguments (passed by pipes)
-		int bufsize = LSH_RL_BUFSIZE;
-		char *buffer = malloc(sizeof(char) * bufsize), *c;
-		int position = 1;
-
-		while (buffer) {
-			// Read buffers from stdin
-			c = fgets(buffer, bufsize, stdin);
-			if (!c){
-				// End of the input
-				break;
-			} else {
-				// Store buffer to args.
-				buffer[strcspn(buffer, "\n")] = 0;
-				args[position++] = strdup(buffer);
-			}
+	ssize_t n;
 
-			if (position >= bufsize) {
-				// If we have exceeded the buffer, reallocate.
-				bufsize += LSH_RL_BUFSIZE;
-				buffer = realloc(buffer, bufsize);
-				if (!buffer) {
-					fprintf(stderr, "lsh: allocation error\n");
-					exit(EXIT_FAILURE);
-				}
-			}
-		}
+	if (in->mapped) {
+		// Nothing to copy: index the next block of the mapping.
+		n = in->arena.cap - in->arena.used;
+		if (n > LSH_LINES_READSIZE)
+			n = LSH_LINES_READSIZE;
+	} else {
+		lsh_arena_reserve(&in->arena, LSH_LINES_READSIZE);
+		do {
+			n = read(fd, in->arena.buf + in->arena.used, LSH_LINES_READSIZE);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0)
+			perror("lsh");
 	}
-
-	// Count number in args
-	while (args[len] != NULL)
-		len++;
-	// Bubble sort
-	for (i = 1; i < len ; ++i) {
-		for(j = i + 1; j < len; ++j) {
-			if(strcmp(args[i], args[j]) > 0) {
-				temp = args[i];
-				args[i] = args[j];
-				args[j] = temp;
-			}
+	if (n <= 0) {
+		if (in->start < in->arena.used) {
+			// Last line had no newline.
+			lsh_line_push(&in->line, &in->n, &in->cap, in->start,
+			              in->arena.used - in->start);
+			in->start = in->arena.used;
 		}
+		return 0;
 	}
-
-	// Print
-	for (i = 1; i < len; i++) 
-		printf("[%d]: %s\n", i,( args[i]));
-	return 1;
+	lsh_lines_index(in, in->arena.used, in->arena.used + n);
+	in->arena.used += n;
+	return n;
 }
 
 /**
-   @brief Launch a program and wait for it to terminate.
-   @param args Null terminated list of arguments (including program).
-   @return Always returns 1, to continue execution.
+   @brief Forget the indexed lines, keeping only the partial one.
 */
-int lsh_launch(char **args) {
-	int i = 0;
-			
-	// Execute inbuild commands
-	for (int j = 0; j < lsh_num_builtins(); j++) {
-		if (strcmp(args[0], builtin_str[j]) == 0) 
-			return (*builtin_func[j])(args);
+void lsh_lines_restart(struct lsh_lines *in)
+{
+	if (!in->mapped) {
+		memmove(in->arena.buf, in->arena.buf + in->start,
+		        in->arena.used - in->start);
+		in->arena.used -= in->start;
+		in->start = 0;
 	}
+	in->n = 0;
+}
 
-	// Execute external commands
-	pid_t pid; int status;
-	pid = fork();
-	if (pid == 0) {
-		// Child process
-		if (execvp(args[0], args) == -1)
-			perror("lsh");
-		exit(EXIT_FAILURE);
-	} else if (pid < 0) {
-		// Error creating process
-		perror("lsh");
-	} else {
-		// Parent process
-		do 
-			waitpid(pid, &status, WUNTRACED);
-		while (!WIFEXITED(status) && !WIFSIGNALED(status));
-	}
-	return 1; // return 1 to continue
+/**
+   @brief Memory the input holds on to.  A mapping is page cache the
+   kernel can drop, so only the index counts for it.
+*/
+size_t lsh_lines_size(const struct lsh_lines *in)
+{
+	return (in->mapped ? 0 : in->arena.used) + in->n * sizeof(struct lsh_line);
 }
 
 /**
-   @brief Execute shell built-in or launch program.
-   @param args Null terminated list of arguments.
-   @return 1 if the shell should continue running, 0 if it should terminate
+   @brief Release the input's buffer and index.
 */
-int lsh_execute(char **args)
+void lsh_lines_free(struct lsh_lines *in)
 {
-	int i;
-	pid_t pid;
-	int status;
+	if (in->mapped)
+		munmap(in->arena.buf, in->arena.cap);
+	else
+		free(in->arena.buf);
+	free(in->line);
+}
 
-	if (args[0] == NULL) {
-		// An empty command was entered.
-		return 1;
-	}
+/*
+  File copying for cat.  Data is moved from the file to the output with
+  sendfile() (or splice() into a pipe) so it never passes through user space;
+  when the kernel refuses both, regular files are mmap()ed and anything else
+  goes through a large aligned buffer.
+*/
+#define LSH_CAT_BUFSIZE (128 * 1024)
+#define LSH_CAT_CHUNK (1 << 30)
 
-	int pipe_locate[10], pipe_count = 0;
-	pipe_locate[0] = -1;
-	int len = 0;
-	while (args[len] != NULL)
-		len++;
+/**
+   @brief Copy a descriptor to another until end of file.
+   @param in Descriptor to read from.
+   @param out Descriptor to write to.
+   @return 0 on success, -1 on error.
+*/
+int lsh_copy_fd(int in, int out)
+{
+	struct stat in_st, out_st;
+	ssize_t n;
+	int out_pipe;
 
-	for (i = 0; args[i] != NULL; i++) {
-		// Check for pipes
-		if (strcmp(args[i], "|") == 0) {
-			pipe_count++;
-			pipe_locate[pipe_count] = i;
-			args[i] = NULL;
+	if (fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0)
+		return -1;
+	out_pipe = S_ISFIFO(out_st.st_mode);
+
+	// File to file: let the filesystem copy (or reflink) the extents.
+	if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+		while ((n = copy_file_range(in, NULL, out, NULL, LSH_CAT_CHUNK, 0)) > 0)
+			;
+		if (n == 0)
+			return 0;
+		// Not supported here (across filesystems, O_APPEND, old kernel).
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+		    errno != EOPNOTSUPP && errno != EBADF)
+			return -1;
+	}
+
+	// Zero-copy: sendfile() to a file or pipe, splice() into a pipe.
+	if (S_ISREG(out_st.st_mode) || out_pipe) {
+		while ((n = sendfile(out, in, NULL, LSH_CAT_CHUNK)) > 0)
+			;
+		if (n == 0)
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+		if (out_pipe) {
+			while ((n = splice(in, NULL, out, NULL, LSH_CAT_CHUNK,
+			                   SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+				;
+			if (n == 0)
+				return 0;
+			if (errno != EINVAL && errno != ENOSYS)
+				return -1;
 		}
 	}
 
-	int pfd[9][2];
-	if (pipe_count == 0) {
-		// No pipe: execute and return
-		pid = fork();
-		if (pid == 0) {
-			// Child Process
-			exit(lsh_launch(args));
-		} else {
-			// Parent Process
-			do {
-				waitpid(pid, &status, WUNTRACED);
-			} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-			return WEXITSTATUS(status);
-		}
-	}
-
-	for (i = 0; i < pipe_count + 1; i++) {
-		if (i != pipe_count)
-			// Pipe created
-			pipe(pfd[i]);
-		if (fork() == 0) {
-			// Child Process
-			if (i == 0){
-				// The first pipe (STDOUT -> PIPE)
-				dup2(pfd[0][1], 1);
-				close(pfd[0][0]); close(pfd[0][1]);
-			} else if (i == pipe_count) {
-				// The last pipe (PIPE -> STDIN)
-				dup2(pfd[i - 1][0], 0);
-				close(pfd[i - 1][0]); close(pfd[i - 1][1]);
-			} else {
-				// Mid pipe (STDOUT -> PIPE -> STDIN)
-				dup2(pfd[i - 1][0], 0);
-				dup2(pfd[i][1], 1);
-				close(pfd[i - 1][0]); close(pfd[i - 1][1]);
-				close(pfd[i][0]); close(pfd[i][1]);
+	// Regular file: map it and write it out in one go.  procfs and sysfs
+	// files say they are empty, and any file may have grown since the
+	// fstat(), so the read() loop below still picks up whatever follows.
+	if (S_ISREG(in_st.st_mode) && in_st.st_size > 0) {
+		off_t pos = lseek(in, 0, SEEK_CUR);
+		if (pos >= 0 && pos < in_st.st_size) {
+			char *map = mmap(NULL, in_st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+			if (map != MAP_FAILED) {
+				madvise(map, in_st.st_size, MADV_SEQUENTIAL);
+				n = lsh_write_all(out, map + pos, in_st.st_size - pos);
+				munmap(map, in_st.st_size);
+				if (n < 0 || lseek(in, in_st.st_size, SEEK_SET) < 0)
+					return -1;
 			}
-			lsh_launch(args + pipe_locate[i] + 1);
-			exit(0);
-		} else if (i > 0) {
-			// Parent Process
-			// Close used pipes
-			close(pfd[i - 1][0]); close(pfd[i - 1][1]);
 		}
-	} 
+	}
 
-	for (i = 0; i < pipe_count + 1; i++) {
-		wait(&status);
+	// Anything else: large aligned buffer.
+	char *buffer;
+	int r = 0;
+	if (posix_memalign((void **) &buffer, sysconf(_SC_PAGESIZE), LSH_CAT_BUFSIZE) != 0) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
 	}
-	return 1;
+	while ((n = read(in, buffer, LSH_CAT_BUFSIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			r = -1;
+			break;
+		}
+		if (lsh_write_all(out, buffer, n) < 0) {
+			r = -1;
+			break;
+		}
+	}
+	free(buffer);
+	return r;
 }
 
-#define LSH_RL_BUFSIZE 1024
 /**
-   @brief Read a line of input from stdin.
-   @return The line from stdin.
+   @brief Copy a descriptor to stdout with each line numbered, as "cat -n".
+   @param fd Descriptor to read from.
+   @param number Lines numbered so far, carried over between files.
+   @param bol Whether output is at the start of a line, also carried over:
+   a file that ends without a newline runs on into the next one.
 */
-char *lsh_read_line(void)
+void lsh_cat_number(int fd, unsigned long *number, int *bol)
 {
-	int bufsize = LSH_RL_BUFSIZE;
-	int position = 0;
-	char *buffer = malloc(sizeof(char) * bufsize);
-	int c;
-
-	if (!buffer) {
-		fprintf(stderr, "lsh: allocation error\n");
-		exit(EXIT_FAILURE);
-	}
-
-	while (1) {
-		// Read a character
-		c = getchar();
-
-		if (c == EOF) {
-			exit(EXIT_SUCCESS);
-		} else if (c == '\n') {
-			buffer[position] = '\0';
-			return buffer;
-		} else {
-			buffer[position] = c;
-		}
-		position++;
+	struct lsh_lines in = { { NULL, 0, 0 }, NULL, 0, 0, 0, 0 };
+	size_t r, k;
+	char num[24];
+	int len;
 
-		// If we have exceeded the buffer, reallocate.
-		if (position >= bufsize) {
-			bufsize += LSH_RL_BUFSIZE;
-			buffer = realloc(buffer, bufsize);
-			if (!buffer) {
-				fprintf(stderr, "lsh: allocation error\n");
-				exit(EXIT_FAILURE);
+	lsh_lines_map(&in, fd);
+	do {
+		r = lsh_lines_read(&in, fd);
+		for (k = 0; k < in.n; k++) {
+			if (*bol) {
+				len = snprintf(num, sizeof(num), "%6lu\t", ++*number);
+				lsh_out_write(num, len);
 			}
+			lsh_out_write(in.arena.buf + in.line[k].off, in.line[k].len);
+			// Only the line indexed at end of input can lack a newline.
+			*bol = r > 0 || in.start > in.line[k].off + in.line[k].len;
+			if (*bol)
+				lsh_out_char('\n');
 		}
-	}
+		lsh_lines_restart(&in);
+	} while (r > 0);
+	lsh_lines_free(&in);
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
 /**
-   @brief Split a line into tokens (very naively).
-   @param line The line.
-   @return Null-terminated array of tokens.
+   @brief Open a file for cat and ask the kernel to start reading it in.
+   @param name The file.
+   @return Its descriptor, or -1 if it cannot be opened.
 */
-char **lsh_split_line(char *line)
+int lsh_cat_open(const char *name)
 {
-	int bufsize = LSH_TOK_BUFSIZE, position = 0;
-	char **tokens = malloc(bufsize * sizeof(char*));
-	char *token, **tokens_backup;
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
 
-	if (!tokens) {
-		fprintf(stderr, "lsh: allocation error\n");
-		exit(EXIT_FAILURE);
-	}
+	if (fd >= 0)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	return fd;
+}
 
-	token = strtok(line, LSH_TOK_DELIM);
-	while (token != NULL) {
-		tokens[position] = token;
-		position++;
+/**
+   @brief Bultin command: print file
+   @param args List of args.  args[0] is "cat".  "-n" numbers the output
+   lines.  The rest are the files to print, one after the other; a file
+   that cannot be opened is reported and skipped.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_cat(char **args) {
+	unsigned long number = 0;
+	struct stat out_st, in_st;
+	int file, next, numbered = 0, bol = 1;
+	int len = 0;
 
-		if (position >= bufsize) {
-			bufsize += LSH_TOK_BUFSIZE;
-			tokens_backup = tokens;
-			tokens = realloc(tokens, bufsize * sizeof(char*));
-			if (!tokens) {
-				free(tokens_backup);
-				fprintf(stderr, "lsh: allocation error\n");
-				exit(EXIT_FAILURE);
-			}
-		}
+	// Count number in args
+	while (args[len] != NULL)
+		len++;
 
-		token = strtok(NULL, LSH_TOK_DELIM);
+	if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+		numbered = 1;
+		args++;
+		len--;
 	}
-	tokens[position] = NULL;
-	return tokens;
-}
+	if (len < 2) {
+		fprintf(stderr, "Error: usage: cat [-n] filename\n");
+		return 1;
+	}
+	// Anything printed so far must come out first.
+	lsh_out_flush();
+	if (fstat(1, &out_st) < 0)
+		out_st.st_mode = 0;
 
+	// Keep one file open ahead, so it is read in while this one is copied.
+	next = lsh_cat_open(args[1]);
+	for (int i = 1; i < len; i++) {
+		file = next;
+		next = i + 1 < len ? lsh_cat_open(args[i + 1]) : -1;
+		if (file < 0) {
+			// Reported in its turn, not when it was opened ahead.
+			fprintf(stderr, "Error: %s: file not found\n", args[i]);
+			continue;
+		}
+		if (S_ISREG(out_st.st_mode) && fstat(file, &in_st) == 0 &&
+		    in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+			// "cat f >> f" would never end.
+			fprintf(stderr, "lsh: cat: %s: input file is output file\n", args[i]);
+		} else if (numbered) {
+			lsh_cat_number(file, &number, &bol);
+		} else if (lsh_copy_fd(file, 1) < 0) {
+			perror("lsh: cat");
+		}
+		close(file);
+	}
+	return 1;
+}
 
 /**
-   @brief Loop getting input and executing it.
+   @brief Builtin command: print help.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
 */
-void lsh_loop(void)
+int lsh_help(char **args)
 {
-	char *line;
-	char **args;
-	int status;
+	int i;
+	lsh_out_str("Shunsuke Haga's SHSH\n");
+	lsh_out_str("the forked project from Stephen Brennan's LSH\n");
+	lsh_out_str("Type program names and arguments, and hit enter.\n");
+	lsh_out_str("The following are built in:\n");
 
-	do {
-		printf("shsh!%% ");
-		line = lsh_read_line();
-		args = lsh_split_line(line);
-		status = lsh_execute(args);
+	for (i = 0; i < lsh_nbuiltins; i++) {
+		lsh_out_str("  ");
+		lsh_out_str(lsh_builtins[i].name);
+		lsh_out_char('\n');
+	}
 
-		free(line);
-		free(args);
-	} while (status);
+	lsh_out_str("Use the man command for information on other programs.\n");
+	return 1;
 }
 
 /**
-   @brief Main entry point.
-   @param argc Argument count.
-   @param argv Argument vector.
-   @return status code
+   @brief Builtin command: exit.
+   @param args List of args.  Not examined.
+   @return Always returns 0, to terminate execution.
 */
-int main(int argc, char **argv)
+int lsh_exit(char **args)
 {
-	// Load config files, if any.
-	setenv("0", "- SHSH", 1);
-	setenv("SHELL", "- SHSH", 1);
+	return 0;
+}
+
+/*
+  Sort engine.  Input that fits in the memory budget is sorted in place with
+  qsort(); anything larger is cut into sorted runs that are spilled to temp
+  files and then combined with a k-way merge.  It sorts an index of the
+  input lines, never the lines themselves.
+*/
+#define LSH_SORT_BUFSIZE (64 * 1024 * 1024)
+#define LSH_SORT_NMERGE 16
+
+/*
+  Arena the line index being sorted refers to.  qsort() has no context
+  argument, and the arena does not move while a sort is running.
+*/
+const char *lsh_sort_base;
+
+/*
+  Options of the running sort, global for the same reason.
+*/
+struct lsh_sort_opts {
+	int radix;	// --radix: MSD radix sort instead of qsort()
+	int numeric;	// -n
+	int reverse;	// -r
+	int unique;	// -u
+	int kfirst;	// -k kfirst[,klast]: fields, from 1; 0 for the whole line
+	int klast;	// 0 for the end of the line
+	int tab;	// -t: field separator, or -1 for runs of blanks
+	size_t top;	// --top=K: print only the first K lines, 0 for all
+} lsh_sort_opt;
+
+/*
+  Line count the next sort may stop at, set by the pipeline launcher when
+  the sort feeds "head -n K".  Output past lsh_sort_limit is dropped.
+*/
+size_t lsh_sort_top_hint;
+size_t lsh_sort_limit;
+
+/**
+   @brief Parse a size such as "4096", "512K", "64M" or "1G".
+   @param str The string to parse.
+   @param size Where to store the size in bytes.
+   @return 0 on success, -1 if the string is not a valid size.
+*/
+int lsh_parse_size(const char *str, size_t *size)
+{
+	char *end;
+	unsigned long long n = strtoull(str, &end, 10);
+
+	if (end == str)
+		return -1;
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; end++; break;
+	case 'm': case 'M': n <<= 20; end++; break;
+	case 'g': case 'G': n <<= 30; end++; break;
+	}
+	if (*end != '\0' || n == 0)
+		return -1;
+	*size = n;
+	return 0;
+}
+
+/**
+   @brief Compare two byte strings the way strcmp() would.
+*/
+int lsh_bytes_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+
+	if (r != 0)
+		return r;
+	return (alen > blen) - (alen < blen);
+}
+
+/**
+   @brief Skip from p to the start of the next field of a line.
+*/
+const char *lsh_sort_field_end(const char *p, const char *end)
+{
+	if (lsh_sort_opt.tab >= 0) {
+		p = memchr(p, lsh_sort_opt.tab, end - p);
+		return p ? p : end;
+	}
+	// A field is its leading blanks plus the word after them.
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	while (p < end && *p != ' ' && *p != '\t')
+		p++;
+	return p;
+}
+
+/**
+   @brief Order preserving integer for a number at the start of a key:
+   optional blanks and '-', digits, optional fraction.  Anything else is 0.
+*/
+uint64_t lsh_sort_number(const char *p, const char *end)
+{
+	double v = 0, scale = 1;
+	int neg = 0;
+	uint64_t u;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		v = v * 10 + (*p - '0');
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+			v += (*p - '0') * (scale /= 10);
+	}
+	if (neg && v != 0)
+		v = -v;
+	// IEEE doubles order like sign-magnitude integers.
+	memcpy(&u, &v, sizeof(u));
+	return u >> 63 ? ~u : u | (1ULL << 63);
+}
+
+/**
+   @brief Parse the sort key of a line, once, into the line itself.
+   @param base Buffer the line's offset refers to.
+   @param line The line.
+*/
+void lsh_sort_parse(const char *base, struct lsh_line *line)
+{
+	const char *start = base + line->off, *end = start + line->len, *p = start;
+	const char *kend = end;
+	uint64_t key = 0;
+	int f;
+
+	if (lsh_sort_opt.kfirst > 0) {
+		for (f = 1; f < lsh_sort_opt.kfirst && p < end; f++) {
+			p = lsh_sort_field_end(p, end);
+			if (lsh_sort_opt.tab >= 0 && p < end)
+				p++;
+		}
+		if (f < lsh_sort_opt.kfirst)
+			p = end;
+		if (lsh_sort_opt.klast >= lsh_sort_opt.kfirst) {
+			for (kend = p; f <= lsh_sort_opt.klast && kend < end; f++) {
+				if (f > lsh_sort_opt.kfirst && lsh_sort_opt.tab >= 0)
+					kend++;
+				kend = lsh_sort_field_end(kend, end);
+			}
+		}
+	}
+	line->koff = p - base;
+	line->klen = kend - p;
+	if (lsh_sort_opt.numeric) {
+		line->key = lsh_sort_number(p, kend);
+		return;
+	}
+	memcpy(&key, p, line->klen < 8 ? line->klen : 8);
+	line->key = be64toh(key);
+}
+
+/**
+   @brief Parse the key of every line, so that most comparisons are decided
+   on the key alone, without touching the lines.
+*/
+void lsh_sort_keys(const char *base, struct lsh_line *lines, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		lsh_sort_parse(base, &lines[i]);
+}
+
+/**
+   @brief Compare two parsed lines under the current options.
+   @param a Buffer x refers to.
+   @param x First line.
+   @param b Buffer y refers to.
+   @param y Second line.
+*/
+int lsh_sort_compare(const char *a, const struct lsh_line *x,
+                     const char *b, const struct lsh_line *y)
+{
+	int r;
+
+	if (x->key != y->key) {
+		r = x->key < y->key ? -1 : 1;
+	} else if (lsh_sort_opt.numeric) {
+		// Same key is the same number.
+		r = 0;
+	} else if (x->klen <= 8 || y->klen <= 8) {
+		// Same key: a key of 8 bytes or less is a prefix of the other one.
+		r = (x->klen > y->klen) - (x->klen < y->klen);
+	} else {
+		r = lsh_bytes_cmp(a + x->koff + 8, x->klen - 8, b + y->koff + 8, y->klen - 8);
+	}
+	if (r == 0 && !lsh_sort_opt.unique &&
+	    (lsh_sort_opt.numeric || lsh_sort_opt.kfirst > 0))
+		// Equal keys: the whole lines decide, as in sort(1).
+		r = lsh_bytes_cmp(a + x->off, x->len, b + y->off, y->len);
+	return lsh_sort_opt.reverse ? -r : r;
+}
+
+/**
+   @brief qsort() comparator for a line index into lsh_sort_base.  Lines
+   that compare equal keep their input order, so that which of them -u
+   keeps does not depend on qsort() being stable (which C does not
+   promise) or on the number of threads.
+*/
+int lsh_sort_cmp(const void *a, const void *b)
+{
+	const struct lsh_line *x = a, *y = b;
+	int r = lsh_sort_compare(lsh_sort_base, x, lsh_sort_base, y);
+
+	if (r == 0)
+		r = (x->off > y->off) - (x->off < y->off);
+	return r;
+}
+
+/*
+  MSD radix sort on the bytes of the lines: distribute by the byte at the
+  current depth (0 for "line ended", which sorts first), then sort each
+  bucket on the next byte.  The first 8 bytes come from the keys.  Small
+  buckets are left to qsort().
+*/
+#define LSH_RADIX_MIN 64
+
+/**
+   @brief Bucket of a line at a depth: 0 if it is that short, else 1 + byte.
+*/
+unsigned int lsh_radix_byte(const struct lsh_line *line, size_t depth)
+{
+	if (line->len <= depth)
+		return 0;
+	if (depth < 8)
+		return ((line->key >> (56 - 8 * depth)) & 0xff) + 1;
+	return (unsigned char) lsh_sort_base[line->off + depth] + 1;
+}
+
+/**
+   @brief Radix sort lines that agree on their first depth bytes.
+   @param lines The lines to sort.
+   @param tmp Scratch space for n lines.
+   @param n Number of lines.
+   @param depth Number of bytes already known to be equal.
+*/
+void lsh_radix_sort(struct lsh_line *lines, struct lsh_line *tmp, size_t n,
+                    size_t depth)
+{
+	size_t count[257], start[257], i, bigstart = 0;
+	unsigned int b, big;
+
+	while (n >= LSH_RADIX_MIN) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[lsh_radix_byte(&lines[i], depth)]++;
+		b = lsh_radix_byte(&lines[0], depth);
+		if (count[b] == n) {
+			// One bucket only: nothing to move, look at the next byte.
+			if (b == 0)
+				return;
+			depth++;
+			continue;
+		}
+
+		start[0] = 0;
+		for (b = 1; b < 257; b++)
+			start[b] = start[b - 1] + count[b - 1];
+		for (i = 0; i < n; i++)
+			tmp[start[lsh_radix_byte(&lines[i], depth)]++] = lines[i];
+		memcpy(lines, tmp, n * sizeof(struct lsh_line));
+
+		// Lines that ended are equal; every other bucket goes one deeper.
+		// Only buckets smaller than the largest one recurse, each at most
+		// half of n, so the stack stays O(log n) deep; the largest is
+		// sorted by the next trip round the loop.
+		big = 1;
+		for (b = 2; b < 257; b++)
+			if (count[b] > count[big])
+				big = b;
+		for (b = 1, i = count[0]; b < 257; i += count[b++]) {
+			if (b == big)
+				bigstart = i;
+			else if (count[b] > 1)
+				lsh_radix_sort(lines + i, tmp, count[b], depth + 1);
+		}
+		lines += bigstart;
+		n = count[big];
+		depth++;
+	}
+	qsort(lines, n, sizeof(struct lsh_line), lsh_sort_cmp);
+}
+
+/**
+   @brief Sort part of a line index on the calling thread.
+*/
+void lsh_sort_range(struct lsh_line *lines, size_t n)
+{
+	struct lsh_line *tmp;
+
+	if (!lsh_sort_opt.radix || lsh_sort_opt.numeric || lsh_sort_opt.reverse ||
+	    lsh_sort_opt.kfirst > 0) {
+		// The radix sort only knows plain byte order.
+		qsort(lines, n, sizeof(struct lsh_line), lsh_sort_cmp);
+		return;
+	}
+	if (!(tmp = malloc(n * sizeof(struct lsh_line)))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	lsh_radix_sort(lines, tmp, n, 0);
+	free(tmp);
+}
+
+/*
+  Parallel in-memory sort: the lines are cut into one chunk per thread, each
+  chunk is qsort()ed on its own thread, and adjacent chunks are then merged
+  pairwise (again one merge per thread) until a single sorted array is left.
+*/
+#define LSH_SORT_MINCHUNK 4096
+
+struct lsh_sort_job {
+	struct lsh_line *src;
+	struct lsh_line *dst;
+	size_t lo, mid, hi;
+};
+
+/**
+   @brief Thread body: sort one chunk in place.
+*/
+void *lsh_sort_chunk(void *arg)
+{
+	struct lsh_sort_job *job = arg;
+
+	lsh_sort_range(job->src + job->lo, job->hi - job->lo);
+	return NULL;
+}
+
+/**
+   @brief Thread body: merge src[lo, mid) and src[mid, hi) into dst[lo, hi).
+*/
+void *lsh_sort_pair(void *arg)
+{
+	struct lsh_sort_job *job = arg;
+	size_t i = job->lo, j = job->mid, k = job->lo;
+
+	while (i < job->mid && j < job->hi) {
+		if (lsh_sort_cmp(&job->src[j], &job->src[i]) < 0)
+			job->dst[k++] = job->src[j++];
+		else
+			job->dst[k++] = job->src[i++];
+	}
+	while (i < job->mid)
+		job->dst[k++] = job->src[i++];
+	while (j < job->hi)
+		job->dst[k++] = job->src[j++];
+	return NULL;
+}
+
+/**
+   @brief Run fn over every job, one thread per job.
+   @param fn Thread body.
+   @param jobs Jobs to run.
+   @param njobs Number of jobs.
+*/
+void lsh_sort_run_jobs(void *(*fn)(void *), struct lsh_sort_job *jobs, int njobs)
+{
+	pthread_t *tid = malloc(njobs * sizeof(pthread_t));
+	char *started = calloc(njobs, 1);
+	int i;
+
+	if (!tid || !started) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < njobs; i++)
+		started[i] = pthread_create(&tid[i], NULL, fn, &jobs[i]) == 0;
+	for (i = 0; i < njobs; i++) {
+		if (started[i])
+			pthread_join(tid[i], NULL);
+		else
+			// Could not get a thread: do the work here instead.
+			fn(&jobs[i]);
+	}
+	free(tid);
+	free(started);
+}
+
+/**
+   @brief Sort a line index, using up to nthreads threads.
+   @param base Arena the index refers to.
+   @param lines The lines to sort.
+   @param n Number of lines.
+   @param nthreads Number of worker threads.
+*/
+void lsh_sort_lines(const char *base, struct lsh_line *lines, size_t n,
+                    int nthreads)
+{
+	struct lsh_sort_job *jobs;
+	struct lsh_line *tmp, *src = lines, *dst;
+	size_t *bound, chunk;
+	int nchunks, i;
+
+	lsh_sort_base = base;
+	lsh_sort_keys(base, lines, n);
+	if ((size_t) nthreads > n / LSH_SORT_MINCHUNK)
+		nthreads = n / LSH_SORT_MINCHUNK;
+	if (nthreads <= 1) {
+		lsh_sort_range(lines, n);
+		return;
+	}
+
+	jobs = malloc(nthreads * sizeof(*jobs));
+	bound = malloc((nthreads + 1) * sizeof(size_t));
+	tmp = malloc(n * sizeof(struct lsh_line));
+	if (!jobs || !bound || !tmp) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Sort each chunk on its own thread.
+	nchunks = nthreads;
+	chunk = n / nchunks;
+	for (i = 0; i < nchunks; i++)
+		bound[i] = i * chunk;
+	bound[nchunks] = n;
+	for (i = 0; i < nchunks; i++) {
+		jobs[i].src = lines;
+		jobs[i].lo = bound[i];
+		jobs[i].hi = bound[i + 1];
+	}
+	lsh_sort_run_jobs(lsh_sort_chunk, jobs, nchunks);
+
+	// Merge adjacent chunks pairwise until one is left.
+	dst = tmp;
+	while (nchunks > 1) {
+		int njobs = 0;
+		for (i = 0; i + 1 < nchunks; i += 2) {
+			jobs[njobs].src = src;
+			jobs[njobs].dst = dst;
+			jobs[njobs].lo = bound[i];
+			jobs[njobs].mid = bound[i + 1];
+			jobs[njobs].hi = bound[i + 2];
+			bound[njobs++] = bound[i];
+		}
+		if (i < nchunks) {
+			// Odd chunk out: carry it into the next round unchanged.
+			memcpy(dst + bound[i], src + bound[i],
+			       (bound[i + 1] - bound[i]) * sizeof(struct lsh_line));
+			bound[njobs++] = bound[i];
+		}
+		bound[njobs] = n;
+		lsh_sort_run_jobs(lsh_sort_pair, jobs, nchunks / 2);
+		nchunks = njobs;
+		dst = src;
+		src = src == lines ? tmp : lines;
+	}
+	if (src != lines)
+		memcpy(lines, src, n * sizeof(struct lsh_line));
+
+	free(jobs);
+	free(bound);
+	free(tmp);
+}
+
+/**
+   @brief Write sorted lines to a new temp file.
+   @param base Arena the index refers to.
+   @param lines The lines to spill.
+   @param n Number of lines.
+   @return The run, rewound to its start.
+*/
+FILE *lsh_sort_spill(const char *base, struct lsh_line *lines, size_t n)
+{
+	FILE *run = tmpfile();
+	size_t i;
+
+	if (!run) {
+		perror("lsh: sort");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++) {
+		// With -u a run holds one line of each key already.
+		if (lsh_sort_opt.unique && i > 0 &&
+		    lsh_sort_compare(base, &lines[i - 1], base, &lines[i]) == 0)
+			continue;
+		fwrite(base + lines[i].off, 1, lines[i].len, run);
+		putc('\n', run);
+	}
+	if (fflush(run) != 0) {
+		perror("lsh: sort");
+		exit(EXIT_FAILURE);
+	}
+	rewind(run);
+	return run;
+}
+
+struct lsh_sort_run {
+	FILE *fp;
+	char *line;
+	size_t cap;
+	struct lsh_line key;	// the line within line[], parsed
+	unsigned long seq;	// input order, to break ties (top-K only)
+};
+
+/**
+   @brief Advance a run to its next line.
+   @return 1 if a line was read, 0 at the end of the run.
+*/
+int lsh_sort_next(struct lsh_sort_run *run)
+{
+	ssize_t n = getline(&run->line, &run->cap, run->fp);
+
+	if (n < 0)
+		return 0;
+	if (n > 0 && run->line[n - 1] == '\n')
+		run->line[--n] = '\0';
+	run->key.off = 0;
+	run->key.len = n;
+	lsh_sort_parse(run->line, &run->key);
+	return 1;
+}
+
+/**
+   @brief Compare the current lines of two runs.
+*/
+int lsh_sort_run_cmp(struct lsh_sort_run *a, struct lsh_sort_run *b)
+{
+	return lsh_sort_compare(a->line, &a->key, b->line, &b->key);
+}
+
+/**
+   @brief Whether run a's line goes out before run b's.  Equal lines leave
+   the earlier run first, so that -u keeps the first of them, as sort(1).
+*/
+int lsh_sort_run_before(struct lsh_sort_run *a, struct lsh_sort_run *b)
+{
+	int r = lsh_sort_run_cmp(a, b);
+
+	return r < 0 || (r == 0 && a < b);
+}
+
+/**
+   @brief Restore the heap property below slot i.
+*/
+void lsh_sort_sift(struct lsh_sort_run **heap, int n, int i)
+{
+	struct lsh_sort_run *tmp;
+	int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && lsh_sort_run_before(heap[child + 1], heap[child]))
+			child++;
+		if (!lsh_sort_run_before(heap[child], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/**
+   @brief Print one line of sort output, numbered.
+   @param number Position of the line in the sorted output, from 1.
+   @param line The line, without its newline.
+   @param len Length of the line.
+*/
+void lsh_sort_print(unsigned long number, const char *line, size_t len)
+{
+	if (lsh_sort_limit > 0 && number > lsh_sort_limit)
+		return;
+	lsh_out_char('[');
+	lsh_out_uint(number);
+	lsh_out_write("]: ", 3);
+	lsh_out_write(line, len);
+	lsh_out_char('\n');
+}
+
+/**
+   @brief Merge sorted runs and close them.
+   @param runs The runs to merge.
+   @param nruns Number of runs.
+   @param out Run to write to, or NULL to print numbered lines to stdout.
+   @param number Line counter used when printing.
+*/
+void lsh_sort_merge(FILE **runs, int nruns, FILE *out, int *number)
+{
+	struct lsh_sort_run *run = calloc(nruns + 1, sizeof(*run));
+	struct lsh_sort_run **heap = malloc(nruns * sizeof(*heap));
+	struct lsh_sort_run *last = &run[nruns];	// copy of the line put out last
+	int i, n = 0, any = 0;
+
+	if (!run || !heap) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nruns; i++) {
+		run[i].fp = runs[i];
+		if (lsh_sort_next(&run[i]))
+			heap[n++] = &run[i];
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		lsh_sort_sift(heap, n, i);
+
+	while (n > 0) {
+		if (lsh_sort_opt.unique) {
+			// Drop duplicates while merging, not in a later pass.
+			if (any && lsh_sort_run_cmp(last, heap[0]) == 0)
+				goto next;
+			if (last->cap < heap[0]->key.len + 1) {
+				last->cap = heap[0]->key.len + 1;
+				if (!(last->line = realloc(last->line, last->cap))) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			memcpy(last->line, heap[0]->line, heap[0]->key.len);
+			last->key = heap[0]->key;
+			any = 1;
+		}
+		if (out) {
+			fwrite(heap[0]->line, 1, heap[0]->key.len, out);
+			putc('\n', out);
+		} else {
+			lsh_sort_print(++*number, heap[0]->line, heap[0]->key.len);
+		}
+	next:
+		if (!lsh_sort_next(heap[0]))
+			heap[0] = heap[--n];
+		lsh_sort_sift(heap, n, 0);
+	}
+
+	for (i = 0; i < nruns; i++) {
+		free(run[i].line);
+		fclose(run[i].fp);
+	}
+	free(last->line);
+	free(run);
+	free(heap);
+}
+
+/**
+   @brief Add a spilled run to the list of runs.
+*/
+void lsh_sort_add_run(FILE ***runs, int *nruns, FILE *run)
+{
+	*runs = realloc(*runs, (*nruns + 1) * sizeof(FILE *));
+	if (!*runs) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	(*runs)[(*nruns)++] = run;
+}
+
+/*
+  Top-K mode ("sort --top=K", or "sort | head -n K"): only the K first lines
+  of the output are kept, in a max-heap whose root is the one to drop next,
+  so memory is O(K) and time O(n log K) however long the input.  Entries own
+  a copy of their line, since the input buffer is reused.
+*/
+struct lsh_sort_top {
+	struct lsh_sort_run *entry;
+	size_t n;
+	size_t k;
+	unsigned long seen;	// lines fed so far
+};
+
+/**
+   @brief Order of two top-K entries: as the output, equal lines in
+   input order.
+*/
+int lsh_sort_top_order(struct lsh_sort_run *a, struct lsh_sort_run *b)
+{
+	int r = lsh_sort_run_cmp(a, b);
+
+	if (r == 0)
+		r = (a->seq > b->seq) - (a->seq < b->seq);
+	return r;
+}
+
+/**
+   @brief Restore the max-heap property of the top-K heap below slot i.
+*/
+void lsh_sort_top_sift(struct lsh_sort_top *top, size_t i)
+{
+	struct lsh_sort_run tmp, *e = top->entry;
+	size_t child;
+
+	while ((child = 2 * i + 1) < top->n) {
+		if (child + 1 < top->n && lsh_sort_top_order(&e[child + 1], &e[child]) > 0)
+			child++;
+		if (lsh_sort_top_order(&e[i], &e[child]) >= 0)
+			break;
+		tmp = e[i];
+		e[i] = e[child];
+		e[child] = tmp;
+		i = child;
+	}
+}
+
+/**
+   @brief Offer the indexed lines to the top-K heap.
+*/
+void lsh_sort_top_feed(struct lsh_sort_top *top, struct lsh_lines *in)
+{
+	struct lsh_sort_run *e;
+	struct lsh_line *line;
+	size_t i, j;
+
+	for (i = 0; i < in->n; i++, top->seen++) {
+		line = &in->line[i];
+		lsh_sort_parse(in->arena.buf, line);
+		if (top->n < top->k) {
+			// Still filling: add it and sift it up.
+			e = &top->entry[top->n++];
+		} else if (lsh_sort_compare(in->arena.buf, line, top->entry[0].line,
+		                            &top->entry[0].key) < 0) {
+			// Beats the worst line kept: take its place.  A tie does not,
+			// since the line kept came first.
+			e = &top->entry[0];
+		} else {
+			continue;
+		}
+		if (e->cap < line->len + 1) {
+			e->cap = line->len + 1;
+			if (!(e->line = realloc(e->line, e->cap))) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		memcpy(e->line, in->arena.buf + line->off, line->len);
+		e->key = *line;
+		e->key.off = 0;
+		e->key.koff -= line->off;
+		e->seq = top->seen;
+		if (e == &top->entry[0]) {
+			lsh_sort_top_sift(top, 0);
+			continue;
+		}
+		for (j = top->n - 1; j > 0 && lsh_sort_top_order(&top->entry[(j - 1) / 2],
+		                                                &top->entry[j]) < 0; j = (j - 1) / 2) {
+			struct lsh_sort_run tmp = top->entry[j];
+			top->entry[j] = top->entry[(j - 1) / 2];
+			top->entry[(j - 1) / 2] = tmp;
+		}
+	}
+}
+
+/**
+   @brief qsort() comparator for top-K entries.
+*/
+int lsh_sort_top_cmp(const void *a, const void *b)
+{
+	return lsh_sort_top_order((struct lsh_sort_run *) a, (struct lsh_sort_run *) b);
+}
+
+/**
+   @brief Print the top-K lines in order and free them.
+*/
+void lsh_sort_top_print(struct lsh_sort_top *top)
+{
+	size_t i;
+
+	qsort(top->entry, top->n, sizeof(struct lsh_sort_run), lsh_sort_top_cmp);
+	for (i = 0; i < top->n; i++) {
+		lsh_sort_print(i + 1, top->entry[i].line, top->entry[i].key.len);
+		free(top->entry[i].line);
+	}
+	free(top->entry);
+}
+
+/**
+   @brief Sort input files, spilling to temp files once the budget is used up.
+   @param files Null terminated list of files, "-" for stdin.  Empty to
+   sort stdin.
+   @param budget Approximate number of bytes to hold in memory.
+   @param nthreads Number of threads used to sort each run.
+*/
+void lsh_sort_stream(char **files, size_t budget, int nthreads)
+{
+	struct lsh_lines in = { { NULL, 0, 0 }, NULL, 0, 0, 0, 0 };
+	struct lsh_sort_top top = { NULL, 0, lsh_sort_opt.top, 0 };
+	FILE **runs = NULL;
+	int nruns = 0, number = 0, i = 0, fd = 0;
+	size_t n;
+
+	if (top.k > 0) {
+		top.entry = calloc(top.k, sizeof(struct lsh_sort_run));
+		if (!top.entry) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	do {
+		fd = 0;
+		if (files[i] != NULL && strcmp(files[i], "-") != 0 &&
+		    (fd = open(files[i], O_RDONLY | O_CLOEXEC)) < 0) {
+			fprintf(stderr, "lsh: sort: %s: %s\n", files[i], strerror(errno));
+			continue;
+		}
+		// A single input can be sorted straight out of its mapping.
+		if (files[0] == NULL || files[1] == NULL)
+			lsh_lines_map(&in, fd);
+		while (lsh_lines_read(&in, fd) > 0) {
+			if (top.k > 0) {
+				lsh_sort_top_feed(&top, &in);
+				lsh_lines_restart(&in);
+			} else if (lsh_lines_size(&in) >= budget) {
+				// Out of memory budget: spill a sorted run.
+				lsh_sort_lines(in.arena.buf, in.line, in.n, nthreads);
+				lsh_sort_add_run(&runs, &nruns,
+				                 lsh_sort_spill(in.arena.buf, in.line, in.n));
+				lsh_lines_restart(&in);
+			}
+		}
+		if (fd != 0)
+			close(fd);
+	} while (files[i] != NULL && files[++i] != NULL);
+
+	if (top.k > 0) {
+		lsh_sort_top_feed(&top, &in);
+		lsh_sort_top_print(&top);
+		lsh_lines_free(&in);
+		return;
+	}
+	lsh_sort_lines(in.arena.buf, in.line, in.n, nthreads);
+	if (nruns == 0) {
+		// Everything fit in memory.
+		for (n = 0; n < in.n; n++) {
+			if (lsh_sort_opt.unique && n > 0 &&
+			    lsh_sort_compare(in.arena.buf, &in.line[n - 1],
+			                     in.arena.buf, &in.line[n]) == 0)
+				continue;
+			lsh_sort_print(++number, in.arena.buf + in.line[n].off,
+			               in.line[n].len);
+		}
+		lsh_lines_free(&in);
+		return;
+	}
+	if (in.n > 0)
+		lsh_sort_add_run(&runs, &nruns, lsh_sort_spill(in.arena.buf, in.line, in.n));
+	lsh_lines_free(&in);
+
+	// Merge in passes of at most LSH_SORT_NMERGE runs to bound open files.
+	while (nruns > LSH_SORT_NMERGE) {
+		int merged = 0;
+		for (i = 0; i < nruns; i += LSH_SORT_NMERGE) {
+			int k = nruns - i < LSH_SORT_NMERGE ? nruns - i : LSH_SORT_NMERGE;
+			FILE *out = tmpfile();
+			if (!out) {
+				perror("lsh: sort");
+				exit(EXIT_FAILURE);
+			}
+			lsh_sort_merge(runs + i, k, out, NULL);
+			fflush(out);
+			rewind(out);
+			runs[merged++] = out;
+		}
+		nruns = merged;
+	}
+	lsh_sort_merge(runs, nruns, NULL, &number);
+	free(runs);
+}
+
+/**
+   @brief Parse a "-k" key spec, "N" or "N,M" (fields counted from 1).
+   @return 0 on success, -1 if the spec is not valid.
+*/
+int lsh_sort_key_spec(const char *spec)
+{
+	char *end;
+	long first = strtol(spec, &end, 10), last = 0;
+
+	if (end == spec || first < 1)
+		return -1;
+	if (*end == ',') {
+		spec = end + 1;
+		last = strtol(spec, &end, 10);
+		if (end == spec || last < first)
+			return -1;
+	}
+	if (*end != '\0')
+		return -1;
+	lsh_sort_opt.kfirst = first;
+	lsh_sort_opt.klast = last;
+	return 0;
+}
+
+/**
+   @brief Bultin command: sort
+   @param args List of args.  args[0] is "sort".  The remaining args are
+   the files to sort ("-" is stdin); if there are none, lines are read
+   from stdin.  "-k N[,M]" sorts on fields N to M, split at "-t C" or at
+   blanks; "-n" compares numbers, "-r" reverses and "-u" keeps one line
+   per key.  "-S size" or "--buffer-size=size" caps the memory used before
+   spilling to temp files, "--parallel=N" sorts with N threads and
+   "--radix" uses a radix sort.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_sort(char **args)
+{
+	struct lsh_sort_opts opt = { 0, 0, 0, 0, 0, 0, -1, lsh_sort_top_hint };
+	size_t budget = LSH_SORT_BUFSIZE;
+	int nthreads = 1;
+	int i = 1;
+
+	lsh_sort_opt = opt;
+	// Parse options
+	for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+		const char *size = NULL;
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		} else if (strncmp(args[i], "--buffer-size=", 14) == 0) {
+			size = args[i] + 14;
+		} else if (strncmp(args[i], "--parallel=", 11) == 0) {
+			nthreads = atoi(args[i] + 11);
+			if (nthreads < 1) {
+				fprintf(stderr, "lsh: sort: invalid thread count %s\n", args[i] + 11);
+				return 1;
+			}
+			continue;
+		} else if (strcmp(args[i], "--radix") == 0) {
+			lsh_sort_opt.radix = 1;
+			continue;
+		} else if (strncmp(args[i], "--top=", 6) == 0) {
+			char *end;
+			lsh_sort_opt.top = strtoul(args[i] + 6, &end, 10);
+			if (end == args[i] + 6 || *end != '\0' || lsh_sort_opt.top == 0) {
+				fprintf(stderr, "lsh: sort: invalid line count %s\n", args[i] + 6);
+				return 1;
+			}
+			continue;
+		} else if (args[i][1] != '-') {
+			// Short options, possibly bundled ("-nr", "-k2", "-t,").
+			for (const char *o = args[i] + 1; *o != '\0'; o++) {
+				const char *arg;
+				if (*o == 'n') {
+					lsh_sort_opt.numeric = 1;
+					continue;
+				} else if (*o == 'r') {
+					lsh_sort_opt.reverse = 1;
+					continue;
+				} else if (*o == 'u') {
+					lsh_sort_opt.unique = 1;
+					continue;
+				} else if (*o != 'k' && *o != 't' && *o != 'S') {
+					fprintf(stderr, "lsh: sort: unknown option -%c\n", *o);
+					return 1;
+				}
+				arg = o[1] != '\0' ? o + 1 : args[++i];
+				if (arg == NULL) {
+					fprintf(stderr, "lsh: sort: option -%c needs an argument\n", *o);
+					return 1;
+				}
+				if (*o == 'S') {
+					size = arg;
+				} else if (*o == 'k' && lsh_sort_key_spec(arg) != 0) {
+					fprintf(stderr, "lsh: sort: invalid key %s\n", arg);
+					return 1;
+				} else if (*o == 't') {
+					if (arg[0] == '\0' || arg[1] != '\0') {
+						fprintf(stderr, "lsh: sort: separator must be one character\n");
+						return 1;
+					}
+					lsh_sort_opt.tab = (unsigned char) arg[0];
+				}
+				break;
+			}
+			if (size == NULL)
+				continue;
+		} else {
+			fprintf(stderr, "lsh: sort: unknown option %s\n", args[i]);
+			return 1;
+		}
+		if (lsh_parse_size(size, &budget) != 0) {
+			fprintf(stderr, "lsh: sort: invalid buffer size %s\n", size);
+			return 1;
+		}
+	}
+
+	if (lsh_sort_opt.unique && lsh_sort_opt.top > 0) {
+		// The heap cannot tell duplicates apart: sort it all, print K.
+		lsh_sort_limit = lsh_sort_opt.top;
+		lsh_sort_opt.top = 0;
+	}
+	lsh_sort_stream(args + i, budget, nthreads);
+	lsh_sort_limit = 0;
+	return 1;
+}
+
+/**
+   @brief FNV-1a hash of a string, starting from the given basis.
+*/
+unsigned int lsh_hash_seeded(const char *s, unsigned int h)
+{
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+/**
+   @brief FNV-1a hash of a string.
+*/
+unsigned int lsh_hash_str(const char *s)
+{
+	return lsh_hash_seeded(s, 2166136261u);
+}
+
+/*
+  Builtin dispatch goes through a perfect hash over the registry: the seed
+  of the string hash is chosen so that every builtin lands in its own slot,
+  and a lookup is one hash and one strcmp().  The slot is taken from the top
+  bits of the hash: the low bits of FNV-1a only depend on the low bits of
+  each byte, so names like "cd" and "fg" would collide under every seed.
+  The index is built on first use, in a few microseconds.
+*/
+#define LSH_BUILTIN_SEED_TRIES 4096
+
+unsigned char *lsh_builtin_slot;	// registry index + 1, 0 if empty
+unsigned int lsh_builtin_shift;	// 32 - log2(slots)
+unsigned int lsh_builtin_seed;
+
+/**
+   @brief Build the perfect hash index over the builtin registry.
+*/
+void lsh_builtin_index(void)
+{
+	unsigned int size = 8, bits = 3, seed, h;
+	int i;
+
+	while (size < 2 * (unsigned int) lsh_nbuiltins) {
+		size *= 2;
+		bits++;
+	}
+	while (1) {
+		free(lsh_builtin_slot);
+		lsh_builtin_slot = malloc(size);
+		if (!lsh_builtin_slot) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (seed = 1; seed <= LSH_BUILTIN_SEED_TRIES; seed++) {
+			memset(lsh_builtin_slot, 0, size);
+			for (i = 0; i < lsh_nbuiltins; i++) {
+				h = lsh_hash_seeded(lsh_builtins[i].name, seed) >> (32 - bits);
+				if (lsh_builtin_slot[h] != 0)
+					break;
+				lsh_builtin_slot[h] = i + 1;
+			}
+			if (i == lsh_nbuiltins) {
+				lsh_builtin_shift = 32 - bits;
+				lsh_builtin_seed = seed;
+				return;
+			}
+		}
+		// No collision-free seed at this size: spread the keys out more.
+		size *= 2;
+		bits++;
+	}
+}
+
+/**
+   @brief Look up a builtin by name.
+   @param name Command name.
+   @return Index into lsh_builtins, or -1 if it is not a builtin.
+*/
+int lsh_find_builtin(const char *name)
+{
+	int j;
+
+	if (lsh_builtin_slot == NULL)
+		lsh_builtin_index();
+	j = lsh_builtin_slot[lsh_hash_seeded(name, lsh_builtin_seed) >> lsh_builtin_shift] - 1;
+	if (j >= 0 && strcmp(name, lsh_builtins[j].name) == 0)
+		return j;
+	return -1;
+}
+
+/*
+  Loadable builtins.  "enable -f plugin.so name..." dlopen()s a shared
+  object and registers, for each name, its function lsh_builtin_<name>
+  with the usual int (*)(char **) signature.  The prefix keeps a plugin's
+  "time" or "wc" from resolving to some other library's symbol of that
+  name.  A plugin builtin runs like any other: in the shell when alone,
+  in the stage's fork (without an exec) in a pipeline.  The shell exports
+  none of its own symbols, so a plugin only has libc: it reads and writes
+  with stdio or plain read()/write(), and stdout is flushed after the
+  command.
+*/
+#define LSH_MAX_BUILTINS 255	// slots hold an index + 1 in a byte
+
+/**
+   @brief Add a builtin to the registry, or replace one of that name.
+   @param name Command name; the registry takes ownership.
+   @param func Its function.
+   @return 0 on success, -1 if the registry is full.
+*/
+int lsh_builtin_add(char *name, int (*func)(char **))
+{
+	int j = lsh_find_builtin(name);
+
+	if (j >= 0) {
+		lsh_builtins[j].func = func;
+		free(name);
+		return 0;
+	}
+	if (lsh_nbuiltins >= LSH_MAX_BUILTINS)
+		return -1;
+	if (lsh_builtins == lsh_builtin_table) {
+		// First plugin: move the compiled-in table to the heap.
+		lsh_builtins = malloc(LSH_MAX_BUILTINS * sizeof(struct lsh_builtin));
+		if (!lsh_builtins) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(lsh_builtins, lsh_builtin_table, sizeof(lsh_builtin_table));
+	}
+	lsh_builtins[lsh_nbuiltins].name = name;
+	lsh_builtins[lsh_nbuiltins].func = func;
+	lsh_nbuiltins++;
+	// The seed and size were only good for the old set of names.
+	free(lsh_builtin_slot);
+	lsh_builtin_slot = NULL;
+	return 0;
+}
+
+/**
+   @brief Bultin command: enable
+   @param args List of args.  args[0] is "enable".  "-f FILE name..."
+   loads builtins from a shared object; no arguments lists the builtins.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_enable(char **args)
+{
+	int (*func)(char **);
+	char sym[256], *name;
+	void *handle;
+
+	if (args[1] == NULL) {
+		for (int i = 0; i < lsh_nbuiltins; i++) {
+			lsh_out_str("enable ");
+			lsh_out_str(lsh_builtins[i].name);
+			lsh_out_char('\n');
+		}
+		return 1;
+	}
+	if (strcmp(args[1], "-f") != 0 || args[2] == NULL || args[3] == NULL) {
+		fprintf(stderr, "lsh: enable: usage: enable [-f FILE name...]\n");
+		return 1;
+	}
+	// A plugin stays loaded; the registry points into it from now on.
+	if (!(handle = dlopen(args[2], RTLD_NOW | RTLD_LOCAL))) {
+		fprintf(stderr, "lsh: enable: %s\n", dlerror());
+		return 1;
+	}
+	for (int i = 3; args[i] != NULL; i++) {
+		snprintf(sym, sizeof(sym), "lsh_builtin_%s", args[i]);
+		*(void **) &func = dlsym(handle, sym);
+		if (func == NULL) {
+			fprintf(stderr, "lsh: enable: %s: no %s in %s\n", args[i], sym, args[2]);
+			continue;
+		}
+		if (!(name = strdup(args[i]))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		if (lsh_builtin_add(name, func) < 0) {
+			fprintf(stderr, "lsh: enable: %s: too many builtins\n", args[i]);
+			free(name);
+		}
+	}
+	return 1;
+}
+
+/*
+  Shell variables.  They live in a hash table, filled from the environment
+  on first use, so an expansion is one hash and one compare instead of
+  getenv()'s scan of environ.  Each variable keeps its "NAME=value" string,
+  and environ is rebuilt from the exported ones only when one of them
+  changes, so an exec() never copies anything.
+*/
+#define LSH_VAR_BUCKETS 128
+
+struct lsh_var {
+	char *entry;	// "NAME=value"
+	size_t namelen;
+	unsigned int hash;
+	int exported;
+	struct lsh_var *next;
+};
+
+extern char **environ;
+
+struct lsh_var *lsh_var_table[LSH_VAR_BUCKETS];
+int lsh_var_count;
+int lsh_var_loaded;
+int lsh_var_loading;
+char **lsh_var_environ;	// environ as built here, NULL while it is exec()'s
+
+/**
+   @brief FNV-1a hash of a variable name.
+*/
+unsigned int lsh_var_hash(const char *name, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char) *name++) * 16777619u;
+	return h;
+}
+
+/**
+   @brief Length of the variable name at the start of s, 0 if there is none.
+   A name is a letter or '_' followed by letters, digits and '_'; a single
+   digit is a name too, so that $0 works.
+*/
+size_t lsh_var_namelen(const char *s)
+{
+	size_t n = 0;
+
+	if (*s >= '0' && *s <= '9')
+		return 1;
+	while ((s[n] >= 'a' && s[n] <= 'z') || (s[n] >= 'A' && s[n] <= 'Z') ||
+	       s[n] == '_' || (n > 0 && s[n] >= '0' && s[n] <= '9'))
+		n++;
+	return n;
+}
+
+struct lsh_var *lsh_var_set(const char *name, size_t len, const char *value,
+                            size_t vlen, int exported);
+
+/**
+   @brief Fill the table from the environment the shell was started with.
+*/
+void lsh_var_load(void)
+{
+	char **e, *eq;
+
+	lsh_var_loading = 1;
+	for (e = environ; *e != NULL; e++) {
+		if ((eq = strchr(*e, '=')) != NULL)
+			lsh_var_set(*e, eq - *e, eq + 1, strlen(eq + 1), 1);
+	}
+	lsh_var_loading = 0;
+	lsh_var_loaded = 1;
+}
+
+/**
+   @brief Find a variable.
+   @param name Its name, not necessarily terminated.
+   @param len Length of the name.
+   @return The variable, or NULL if it is not set.
+*/
+struct lsh_var *lsh_var_find(const char *name, size_t len)
+{
+	unsigned int h = lsh_var_hash(name, len);
+	struct lsh_var *v;
+
+	if (!lsh_var_loaded)
+		lsh_var_load();
+	for (v = lsh_var_table[h % LSH_VAR_BUCKETS]; v != NULL; v = v->next)
+		if (v->hash == h && v->namelen == len && memcmp(v->entry, name, len) == 0)
+			return v;
+	return NULL;
+}
+
+/**
+   @brief Value of a variable.
+   @param name Its name, not necessarily terminated.
+   @param len Length of the name.
+   @return The value, or NULL if it is not set.
+*/
+const char *lsh_var_get(const char *name, size_t len)
+{
+	struct lsh_var *v = lsh_var_find(name, len);
+
+	return v ? v->entry + v->namelen + 1 : NULL;
+}
+
+/**
+   @brief Point environ at the exported variables, after one has changed.
+*/
+void lsh_var_export_all(void)
+{
+	struct lsh_var *v;
+	char **env = malloc((lsh_var_count + 1) * sizeof(char *));
+	int i, n = 0;
+
+	if (!env) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < LSH_VAR_BUCKETS; i++)
+		for (v = lsh_var_table[i]; v != NULL; v = v->next)
+			if (v->exported)
+				env[n++] = v->entry;
+	env[n] = NULL;
+	free(lsh_var_environ);
+	environ = lsh_var_environ = env;
+}
+
+/**
+   @brief Set a variable.
+   @param name Its name, not necessarily terminated.
+   @param len Length of the name.
+   @param value The value, not necessarily terminated.
+   @param vlen Length of the value.
+   @param exported 1 to export it, 0 to keep it as it is (new ones are local).
+   @return The variable.
+*/
+struct lsh_var *lsh_var_set(const char *name, size_t len, const char *value,
+                            size_t vlen, int exported)
+{
+	struct lsh_var *v = lsh_var_loading ? NULL : lsh_var_find(name, len);
+	char *entry = malloc(len + vlen + 2), *old = NULL;
+
+	if (!entry || (!v && !(v = calloc(1, sizeof(*v))))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(entry, name, len);
+	entry[len] = '=';
+	memcpy(entry + len + 1, value, vlen);
+	entry[len + vlen + 1] = '\0';
+
+	if (v->entry == NULL) {
+		v->namelen = len;
+		v->hash = lsh_var_hash(name, len);
+		v->next = lsh_var_table[v->hash % LSH_VAR_BUCKETS];
+		lsh_var_table[v->hash % LSH_VAR_BUCKETS] = v;
+		lsh_var_count++;
+	}
+	old = v->entry;
+	v->entry = entry;
+	if (exported)
+		v->exported = 1;
+	// While loading, environ still is exec()'s own and needs no rebuild.
+	if (v->exported && !lsh_var_loading)
+		lsh_var_export_all();
+	free(old);
+	return v;
+}
+
+/**
+   @brief Remove a variable.
+   @param name Its name.
+*/
+void lsh_var_unset(const char *name)
+{
+	size_t len = strlen(name);
+	unsigned int h = lsh_var_hash(name, len);
+	struct lsh_var **p, *v;
+
+	if (!lsh_var_loaded)
+		lsh_var_load();
+	for (p = &lsh_var_table[h % LSH_VAR_BUCKETS]; (v = *p) != NULL; p = &v->next) {
+		if (v->hash == h && v->namelen == len && memcmp(v->entry, name, len) == 0) {
+			*p = v->next;
+			lsh_var_count--;
+			if (v->exported)
+				lsh_var_export_all();
+			free(v->entry);
+			free(v);
+			return;
+		}
+	}
+}
+
+/**
+   @brief Run a command made only of NAME=value words by setting them.
+   @param args The command.
+   @return 1 if it was such a command, 0 (nothing set) otherwise.
+*/
+int lsh_var_assign(char **args)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; args[i] != NULL; i++) {
+		n = lsh_var_namelen(args[i]);
+		if (n == 0 || args[i][n] != '=' || (args[i][0] >= '0' && args[i][0] <= '9'))
+			return 0;
+	}
+	for (i = 0; args[i] != NULL; i++) {
+		n = lsh_var_namelen(args[i]);
+		lsh_var_set(args[i], n, args[i] + n + 1, strlen(args[i] + n + 1), 0);
+	}
+	return 1;
+}
+
+/**
+   @brief Bultin command: export
+   @param args List of args.  args[0] is "export".  Each NAME=value sets
+   and exports a variable, each NAME exports an existing one; no arguments
+   lists the exported variables.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_export(char **args)
+{
+	struct lsh_var *v;
+	size_t n;
+	int i;
+
+	if (args[1] == NULL) {
+		if (!lsh_var_loaded)
+			lsh_var_load();
+		for (i = 0; i < LSH_VAR_BUCKETS; i++) {
+			for (v = lsh_var_table[i]; v != NULL; v = v->next) {
+				if (v->exported) {
+					lsh_out_str("export ");
+					lsh_out_str(v->entry);
+					lsh_out_char('\n');
+				}
+			}
+		}
+		return 1;
+	}
+	for (i = 1; args[i] != NULL; i++) {
+		n = lsh_var_namelen(args[i]);
+		if (n == 0 || (args[i][n] != '=' && args[i][n] != '\0')) {
+			fprintf(stderr, "lsh: export: %s: not a valid name\n", args[i]);
+		} else if (args[i][n] == '=') {
+			lsh_var_set(args[i], n, args[i] + n + 1, strlen(args[i] + n + 1), 1);
+		} else if ((v = lsh_var_find(args[i], n)) != NULL && !v->exported) {
+			v->exported = 1;
+			lsh_var_export_all();
+		}
+	}
+	return 1;
+}
+
+/**
+   @brief Bultin command: unset
+   @param args List of args.  args[0] is "unset".  The rest are the
+   variables to remove.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_unset(char **args)
+{
+	for (int i = 1; args[i] != NULL; i++)
+		lsh_var_unset(args[i]);
+	return 1;
+}
+
+/*
+  Command path cache, as in bash's hash builtin.  The first lookup of a
+  command walks $PATH; later ones come straight from the table, so the
+  launcher can execv() the absolute path without execvp()'s trial execs.
+  The table is dropped whenever $PATH changes.
+*/
+#define LSH_HASH_BUCKETS 64
+
+struct lsh_hash_entry {
+	char *name;
+	char *path;
+	int hits;
+	struct lsh_hash_entry *next;
+};
+
+struct lsh_hash_entry *lsh_hash_table[LSH_HASH_BUCKETS];
+char *lsh_hash_pathvar;
+
+/**
+   @brief Forget every cached path.
+*/
+void lsh_hash_clear(void)
+{
+	struct lsh_hash_entry *e, *next;
+
+	for (int i = 0; i < LSH_HASH_BUCKETS; i++) {
+		for (e = lsh_hash_table[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+		}
+		lsh_hash_table[i] = NULL;
+	}
+}
+
+/**
+   @brief Search $PATH for an executable.
+   @param name Command name, without a slash.
+   @return Newly allocated absolute path, or NULL if not found.
+*/
+char *lsh_path_search(const char *name)
+{
+	const char *dir = lsh_var_get("PATH", 4), *end;
+	size_t namelen = strlen(name), dirlen;
+	struct stat st;
+	char *path;
+
+	if (dir == NULL)
+		return NULL;
+	for (; ; dir = end + 1) {
+		end = strchr(dir, ':');
+		dirlen = end ? (size_t) (end - dir) : strlen(dir);
+		path = malloc(dirlen + namelen + 3);
+		if (!path) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		// An empty entry means the current directory.
+		if (dirlen == 0)
+			strcpy(path, ".");
+		else {
+			memcpy(path, dir, dirlen);
+			path[dirlen] = '\0';
+		}
+		strcat(path, "/");
+		strcat(path, name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			return path;
+		free(path);
+		if (end == NULL)
+			return NULL;
+	}
+}
+
+/**
+   @brief Empty the cache if $PATH changed since it was filled.
+*/
+void lsh_hash_check_path(void)
+{
+	const char *pathvar = lsh_var_get("PATH", 4);
+
+	if (pathvar == NULL)
+		pathvar = "";
+	if (lsh_hash_pathvar == NULL || strcmp(lsh_hash_pathvar, pathvar) != 0) {
+		// $PATH changed: everything cached may be wrong.
+		lsh_hash_clear();
+		free(lsh_hash_pathvar);
+		lsh_hash_pathvar = strdup(pathvar);
+	}
+}
+
+/**
+   @brief Find a command in the cache, searching $PATH on a miss.
+   @param name Command name.
+   @return The cache entry, or NULL if the command was not found.
+*/
+struct lsh_hash_entry *lsh_hash_find(const char *name)
+{
+	unsigned int b = lsh_hash_str(name) % LSH_HASH_BUCKETS;
+	struct lsh_hash_entry *e;
+	char *path;
+
+	lsh_hash_check_path();
+
+	for (e = lsh_hash_table[b]; e != NULL; e = e->next) {
+		if (strcmp(e->name, name) == 0)
+			return e;
+	}
+
+	if ((path = lsh_path_search(name)) == NULL)
+		return NULL;
+	e = malloc(sizeof(*e));
+	if (!e || !(e->name = strdup(name))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	e->path = path;
+	e->hits = 0;
+	e->next = lsh_hash_table[b];
+	lsh_hash_table[b] = e;
+	return e;
+}
+
+/**
+   @brief Resolve a command to the path to exec, counting it as a use.
+   @param name Command name.
+   @return Cached path (owned by the table), or NULL if not found.
+*/
+const char *lsh_hash_lookup(const char *name)
+{
+	struct lsh_hash_entry *e = lsh_hash_find(name);
+
+	if (e == NULL)
+		return NULL;
+	e->hits++;
+	return e->path;
+}
+
+/**
+   @brief Drop one command from the cache.
+*/
+void lsh_hash_forget(const char *name)
+{
+	struct lsh_hash_entry **p = &lsh_hash_table[lsh_hash_str(name) % LSH_HASH_BUCKETS];
+	struct lsh_hash_entry *e;
+
+	for (; (e = *p) != NULL; p = &e->next) {
+		if (strcmp(e->name, name) == 0) {
+			*p = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+			return;
+		}
+	}
+}
+
+/**
+   @brief Bultin command: hash
+   @param args List of args.  args[0] is "hash".  "-r" empties the cache,
+   names are looked up and added to it, and no arguments lists it.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_hash(char **args)
+{
+	struct lsh_hash_entry *e;
+	unsigned long n;
+	int i, width;
+
+	if (args[1] == NULL) {
+		lsh_hash_check_path();
+		lsh_out_str("hits\tcommand\n");
+		for (i = 0; i < LSH_HASH_BUCKETS; i++) {
+			for (e = lsh_hash_table[i]; e != NULL; e = e->next) {
+				// Right-aligned in four columns, as "%4d" would.
+				for (width = 1, n = e->hits; n >= 10; n /= 10)
+					width++;
+				while (width++ < 4)
+					lsh_out_char(' ');
+				lsh_out_uint(e->hits);
+				lsh_out_char('\t');
+				lsh_out_str(e->path);
+				lsh_out_char('\n');
+			}
+		}
+		return 1;
+	}
+	for (i = 1; args[i] != NULL; i++) {
+		if (strcmp(args[i], "-r") == 0) {
+			lsh_hash_clear();
+		} else if (strchr(args[i], '/') == NULL && lsh_find_builtin(args[i]) < 0) {
+			if (lsh_hash_find(args[i]) == NULL)
+				fprintf(stderr, "lsh: hash: %s: not found\n", args[i]);
+		}
+	}
+	return 1;
+}
+
+/*
+  Tracing.  "shsh --trace=FILE" writes a span for every line read, line
+  split, builtin call, spawn and wait to FILE in Chrome trace-event format
+  (load it in chrome://tracing or Perfetto).  When tracing is off the
+  macros below are a single test of lsh_trace_fp; build with -DLSH_NO_TRACE
+  to compile them out entirely.
+*/
+FILE *lsh_trace_fp;
+pid_t lsh_trace_pid;
+
+#ifdef LSH_NO_TRACE
+#define lsh_trace_begin() 0
+#define lsh_trace_end(name, t0, arg) ((void) (t0))
+#else
+#define lsh_trace_begin() (lsh_trace_fp ? lsh_trace_now() : 0)
+#define lsh_trace_end(name, t0, arg) \
+	do { if (lsh_trace_fp) lsh_trace_emit(name, t0, arg); } while (0)
+#endif
+
+/**
+   @brief Current time in nanoseconds, for trace spans.
+*/
+long long lsh_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+   @brief Write one complete span that started at t0 and ends now.
+   @param name Span name.
+   @param t0 Start time from lsh_trace_begin().
+   @param arg Command the span belongs to, or NULL.
+*/
+void lsh_trace_emit(const char *name, long long t0, const char *arg)
+{
+	long long t1 = lsh_trace_now();
+
+	fprintf(lsh_trace_fp, ",\n{\"name\":\"%s\",\"cat\":\"shsh\",\"ph\":\"X\","
+	        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+	        name, t0 / 1e3, (t1 - t0) / 1e3, (int) lsh_trace_pid, (int) lsh_trace_pid);
+	if (arg) {
+		fputs(",\"args\":{\"cmd\":\"", lsh_trace_fp);
+		for (; *arg; arg++) {
+			if (*arg == '"' || *arg == '\\')
+				fprintf(lsh_trace_fp, "\\%c", *arg);
+			else if ((unsigned char) *arg < 0x20)
+				fprintf(lsh_trace_fp, "\\u%04x", *arg);
+			else
+				putc(*arg, lsh_trace_fp);
+		}
+		fputs("\"}", lsh_trace_fp);
+	}
+	putc('}', lsh_trace_fp);
+}
+
+/**
+   @brief Close the trace array at exit.
+*/
+void lsh_trace_close(void)
+{
+	// Forked builtin stages inherit the handler; only the shell writes.
+	if (lsh_trace_fp && getpid() == lsh_trace_pid) {
+		fputs("\n]\n", lsh_trace_fp);
+		fclose(lsh_trace_fp);
+	}
+	lsh_trace_fp = NULL;
+}
+
+/**
+   @brief Start writing a trace.
+   @param path File to write it to.
+*/
+void lsh_trace_open(const char *path)
+{
+	if ((lsh_trace_fp = fopen(path, "w")) == NULL) {
+		perror("lsh: trace");
+		return;
+	}
+	lsh_trace_pid = getpid();
+	// Metadata event first, so every real span can start with a comma.
+	fprintf(lsh_trace_fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	        "\"args\":{\"name\":\"shsh\"}}", (int) lsh_trace_pid);
+	atexit(lsh_trace_close);
+}
+
+/*
+  Launch backends for external programs.  fork() copies the shell's page
+  tables, which gets slow when the shell lives inside a large process;
+  vfork() and posix_spawnp() (clone(CLONE_VM|CLONE_VFORK) in glibc) borrow
+  the parent's memory until the exec instead.  The default can be picked at
+  build time with -DLSH_SPAWN_DEFAULT=... and at run time with SHSH_SPAWN.
+*/
+#define LSH_SPAWN_FORK 0
+#define LSH_SPAWN_VFORK 1
+#define LSH_SPAWN_POSIX 2
+#ifndef LSH_SPAWN_DEFAULT
+#define LSH_SPAWN_DEFAULT LSH_SPAWN_POSIX
+#endif
+
+char *lsh_spawn_str[] = {
+	"fork",
+	"vfork",
+	"posix_spawn"
+};
+
+int lsh_spawn_backend = LSH_SPAWN_DEFAULT;
+posix_spawnattr_t lsh_spawn_attr;
+
+/*
+  The shell ignores SIGPIPE, so that a builtin writing to a reader that has
+  gone away (a coprocess that exited, say) gets EPIPE instead of killing
+  the session.  Every child puts it back to the default before it runs
+  anything, since an ignored signal survives exec().
+*/
+
+/**
+   @brief Ignore SIGPIPE in the shell, pick the launch backend from
+   SHSH_SPAWN, if it is set, and prepare posix_spawn()'s attributes.
+*/
+void lsh_spawn_init(void)
+{
+	char *name = getenv("SHSH_SPAWN");
+	sigset_t pipe_set;
+
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	posix_spawnattr_init(&lsh_spawn_attr);
+	posix_spawnattr_setsigdefault(&lsh_spawn_attr, &pipe_set);
+	posix_spawnattr_setflags(&lsh_spawn_attr, POSIX_SPAWN_SETSIGDEF);
+
+	if (name == NULL)
+		return;
+	for (int i = 0; i < (int) (sizeof(lsh_spawn_str) / sizeof(char *)); i++) {
+		if (strcmp(name, lsh_spawn_str[i]) == 0) {
+			lsh_spawn_backend = i;
+			return;
+		}
+	}
+	fprintf(stderr, "lsh: unknown SHSH_SPAWN backend %s\n", name);
+}
+
+/**
+   @brief Say why a command could not be started, the same way for every
+   launch backend.
+   @param err The exec error.
+   @return The end of the message, after the command name.
+*/
+const char *lsh_spawn_why(int err)
+{
+	return err == ENOENT ? ": command not found\n" :
+		err == EACCES ? ": permission denied\n" : ": cannot execute\n";
+}
+
+/**
+   @brief Report a failed exec from a vfork() child and exit it.  Only
+   write() and _exit(): stdio is not async-signal-safe, and the child
+   shares the parent's memory until it execs or exits.
+   @param name The command.
+*/
+void lsh_spawn_fail(const char *name)
+{
+	const char *why = lsh_spawn_why(errno);
+
+	write(STDERR_FILENO, "lsh: ", 5);
+	write(STDERR_FILENO, name, strlen(name));
+	write(STDERR_FILENO, why, strlen(why));
+	_exit(EXIT_FAILURE);
+}
+
+/**
+   @brief Start an external program without waiting for it.
+   @param args Null terminated list of arguments (including program).
+   @param fd Descriptors to install as stdin, stdout and stderr, -1 to
+   inherit.  Any other descriptor the child must not see has to be
+   close-on-exec.
+   @return The child's pid, or -1 if it could not be started.
+*/
+pid_t lsh_spawn(char **args, const int fd[3])
+{
+	extern char **environ;
+	// volatile: the vfork() child shares this frame with the parent.
+	const char *volatile path = NULL;
+	pid_t pid;
+
+	// Bare command names go through the path cache.
+	if (strchr(args[0], '/') == NULL)
+		path = lsh_hash_lookup(args[0]);
+
+	lsh_out_flush();
+	long long t0 = lsh_trace_begin();
+	if (lsh_spawn_backend == LSH_SPAWN_POSIX) {
+		posix_spawn_file_actions_t fa;
+		int err = 0;
+
+		posix_spawn_file_actions_init(&fa);
+		for (int i = 0; i < 3; i++) {
+			if (fd[i] >= 0) {
+				posix_spawn_file_actions_adddup2(&fa, fd[i], i);
+				posix_spawn_file_actions_addclose(&fa, fd[i]);
+			}
+		}
+		if (path) {
+			err = posix_spawn(&pid, path, &fa, &lsh_spawn_attr, args, environ);
+			if (err == ENOENT) {
+				// Stale entry: the program moved since it was cached.
+				lsh_hash_forget(args[0]);
+				path = NULL;
+			}
+		}
+		if (!path)
+			err = posix_spawnp(&pid, args[0], &fa, &lsh_spawn_attr, args, environ);
+		posix_spawn_file_actions_destroy(&fa);
+		lsh_trace_end("spawn", t0, args[0]);
+		if (err != 0) {
+			fprintf(stderr, "lsh: %s%s", args[0], lsh_spawn_why(err));
+			return -1;
+		}
+		return pid;
+	}
+
+	// Only async-signal-safe calls between vfork() and the exec.
+	pid = lsh_spawn_backend == LSH_SPAWN_VFORK ? vfork() : fork();
+	if (pid == 0) {
+		// Child process
+		signal(SIGPIPE, SIG_DFL);
+		for (int i = 0; i < 3; i++) {
+			if (fd[i] >= 0) {
+				dup2(fd[i], i);
+				close(fd[i]);
+			}
+		}
+		if (path)
+			execv(path, args);
+		execvp(args[0], args);
+		lsh_spawn_fail(args[0]);
+	} else if (pid < 0) {
+		// Error creating process
+		perror("lsh");
+	}
+	lsh_trace_end("spawn", t0, args[0]);
+	return pid;
+}
+
+/*
+  Per-stage resource accounting.  With SHSH_PROFILE set in the environment,
+  or for a command run under the time builtin, every stage is reaped with
+  wait4() and its wall time, CPU time, peak RSS and context switches are
+  reported on stderr.  None of this is collected otherwise.
+*/
+struct lsh_stage_stat {
+	char *name;
+	pid_t pid;
+	struct timespec start;
+	struct timespec end;
+	struct rusage ru;
+};
+
+int lsh_profile;
+
+/**
+   @brief Seconds in a timeval.
+*/
+double lsh_tv_sec(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+   @brief Print the resource usage of each stage of a command.
+   @param st Stage records.
+   @param n Number of stages.
+*/
+void lsh_profile_report(struct lsh_stage_stat *st, int n)
+{
+	for (int i = 0; i < n; i++) {
+		double real = (st[i].end.tv_sec - st[i].start.tv_sec) +
+		              (st[i].end.tv_nsec - st[i].start.tv_nsec) / 1e9;
+		fprintf(stderr, "shsh: [%d] %-12s real %.3fs user %.3fs sys %.3fs "
+		        "maxrss %ldK csw %ld/%ld\n", i, st[i].name ? st[i].name : "",
+		        real, lsh_tv_sec(st[i].ru.ru_utime), lsh_tv_sec(st[i].ru.ru_stime),
+		        st[i].ru.ru_maxrss, st[i].ru.ru_nvcsw, st[i].ru.ru_nivcsw);
+	}
+}
+
+/**
+   @brief Set a to the usage accumulated between snapshots b and a.
+*/
+void lsh_rusage_sub(struct rusage *a, const struct rusage *b)
+{
+	timersub(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+	timersub(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+	a->ru_nvcsw -= b->ru_nvcsw;
+	a->ru_nivcsw -= b->ru_nivcsw;
+}
+
+/**
+   @brief Builtin command: time
+   @param args List of args.  args[0] is "time".  The rest is the command
+   (or pipeline) to run and report on.
+   @return What the command returns.
+*/
+int lsh_time(char **args)
+{
+	int saved = lsh_profile, status, stage = 0;
+	struct lsh_cmd cmd = { NULL, 0, 0, args + 1, 0, 0, &stage, 1, 1, 0 };
+
+	lsh_profile = 1;
+	status = lsh_execute(&cmd);
+	lsh_profile = saved;
+	return status;
+}
+
+/*
+  Redirections.  Files are opened here in the shell, not in the child, so
+  every launch backend (posix_spawn included) only has descriptors to
+  install and an open error is reported before anything starts.
+*/
+char **lsh_redir_argv;
+int lsh_redir_cap;
+
+/**
+   @brief Close the descriptors lsh_redirect() opened.
+   @param opened The descriptors, -1 for none.
+*/
+void lsh_redirect_close(const int opened[3])
+{
+	for (int i = 0; i < 3; i++)
+		if (opened[i] >= 0)
+			close(opened[i]);
+}
+
+/**
+   @brief Open a stage's redirections and strip them from its words.
+   @param stage Null terminated words of one stage, operators included.
+   Never modified, since it may belong to the parse cache.
+   @param fd Descriptors for stdin, stdout and stderr.  Redirected ones
+   are replaced by the opened file, so a file beats a pipe.
+   @param opened Set to the descriptors opened here, -1 otherwise.
+   @return The words without redirections (stage itself if there are
+   none), or NULL on error with nothing left open.
+*/
+char **lsh_redirect(char **stage, int fd[3], int opened[3])
+{
+	int n = 0, i, target, flags, newfd;
+
+	opened[0] = opened[1] = opened[2] = -1;
+	for (i = 0; stage[i] != NULL && !lsh_is_op(stage[i]); i++)
+		;
+	if (stage[i] == NULL)
+		return stage;
+
+	for (i = 0; stage[i] != NULL; i++) {
+		if (n + 1 >= lsh_redir_cap) {
+			lsh_redir_cap = lsh_redir_cap ? lsh_redir_cap * 2 : LSH_TOK_BUFSIZE;
+			lsh_redir_argv = realloc(lsh_redir_argv, lsh_redir_cap * sizeof(char*));
+			if (!lsh_redir_argv) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (!lsh_is_op(stage[i])) {
+			lsh_redir_argv[n++] = stage[i];
+			continue;
+		}
+		if (stage[i + 1] == NULL || lsh_is_op(stage[i + 1])) {
+			fprintf(stderr, "lsh: syntax error near '%s'\n", stage[i]);
+			goto fail;
+		}
+		if (stage[i] == lsh_op_in || stage[i] == lsh_op_dupin) {
+			target = 0;
+			flags = O_RDONLY;
+		} else {
+			target = stage[i] == lsh_op_err || stage[i] == lsh_op_duperr ? 2 : 1;
+			flags = O_WRONLY | O_CREAT |
+				(stage[i] == lsh_op_append ? O_APPEND : O_TRUNC);
+		}
+		if (lsh_is_dup(stage[i])) {
+			char *end;
+			long src = strtol(stage[i + 1], &end, 10);
+			if (end == stage[i + 1] || *end != '\0' || src < 0 || src > INT_MAX) {
+				fprintf(stderr, "lsh: %s: bad file descriptor\n", stage[i + 1]);
+				goto fail;
+			}
+			// 2>&1 means wherever stdout goes by now, file or pipe.
+			if (src < 3 && opened[src] >= 0)
+				src = opened[src];
+			else if (src < 3 && fd[src] >= 0)
+				src = fd[src];
+			newfd = fcntl(src, F_DUPFD_CLOEXEC, 3);
+		} else {
+			newfd = open(stage[i + 1], flags | O_CLOEXEC, 0666);
+		}
+		// The last redirection of a descriptor wins, as in sh.
+		if (opened[target] >= 0)
+			close(opened[target]);
+		opened[target] = newfd;
+		i++;
+		if (opened[target] < 0) {
+			fprintf(stderr, "lsh: %s: %s\n", stage[i], strerror(errno));
+			goto fail;
+		}
+	}
+	lsh_redir_argv[n] = NULL;
+	for (i = 0; i < 3; i++)
+		if (opened[i] >= 0)
+			fd[i] = opened[i];
+	return lsh_redir_argv;
+
+fail:
+	lsh_redirect_close(opened);
+	opened[0] = opened[1] = opened[2] = -1;
+	return NULL;
+}
+
+/**
+   @brief Point the shell's own stdin/stdout/stderr at a builtin's files.
+   @param fd Descriptors to install, -1 to leave one alone.
+   @param saved Set to copies of the replaced descriptors, for
+   lsh_redirect_pop().
+*/
+void lsh_redirect_push(const int fd[3], int saved[3])
+{
+	lsh_out_flush();
+	fflush(stderr);
+	for (int i = 0; i < 3; i++) {
+		saved[i] = -1;
+		if (fd[i] >= 0) {
+			saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+			dup2(fd[i], i);
+		}
+	}
+}
+
+/**
+   @brief Undo lsh_redirect_push() once the builtin is done.
+   @param fd The installed descriptors.
+   @param saved The copies lsh_redirect_push() made.
+*/
+void lsh_redirect_pop(const int fd[3], int saved[3])
+{
+	lsh_out_flush();
+	fflush(stderr);
+	if (fd[0] >= 0) {
+		// Input buffered from the file must not leak to the next reader.
+		__fpurge(stdin);
+		clearerr(stdin);
+	}
+	for (int i = 0; i < 3; i++) {
+		if (saved[i] >= 0) {
+			dup2(saved[i], i);
+			close(saved[i]);
+		}
+	}
+}
+
+/**
+   @brief Launch a program and wait for it to terminate.
+   @param args Null terminated list of arguments (including program).
+   @param fd Redirections for stdin, stdout and stderr, -1 for none.
+   @return The builtin's return value, otherwise 1 to continue execution.
+*/
+int lsh_launch(char **args, const int fd[3]) {
+	struct lsh_stage_stat st = { .name = args[0] };
+	struct rusage before;
+	int ret = 1, saved[3];
+
+	if (args[0] == NULL)
+		// Only redirections: the files have been opened (and created).
+		return 1;
+	if (lsh_var_assign(args))
+		return 1;
+	if (lsh_profile)
+		clock_gettime(CLOCK_MONOTONIC, &st.start);
+
+	// Execute inbuild commands in the shell process itself
+	int j = lsh_find_builtin(args[0]);
+	if (j >= 0) {
+		long long t0 = lsh_trace_begin();
+		if (fd[0] >= 0 || fd[1] >= 0 || fd[2] >= 0)
+			lsh_redirect_push(fd, saved);
+		if (lsh_profile)
+			getrusage(RUSAGE_SELF, &before);
+		ret = (*lsh_builtins[j].func)(args);
+		// The one flush of the command's output.
+		lsh_out_flush();
+		lsh_trace_end("builtin", t0, args[0]);
+		if (fd[0] >= 0 || fd[1] >= 0 || fd[2] >= 0)
+			lsh_redirect_pop(fd, saved);
+		if (!lsh_profile)
+			return ret;
+		getrusage(RUSAGE_SELF, &st.ru);
+		lsh_rusage_sub(&st.ru, &before);
+	} else {
+		// Execute external commands
+		pid_t pid; int status;
+		pid = lsh_spawn(args, fd);
+		if (pid < 0)
+			return 1;
+		// Parent process
+		long long t0 = lsh_trace_begin();
+		do 
+			wait4(pid, &status, WUNTRACED, &st.ru);
+		while (!WIFEXITED(status) && !WIFSIGNALED(status));
+		lsh_trace_end("wait", t0, args[0]);
+	}
+
+	if (lsh_profile) {
+		clock_gettime(CLOCK_MONOTONIC, &st.end);
+		lsh_profile_report(&st, 1);
+	}
+	return ret; // return 1 to continue
+}
+
+/**
+   @brief Run a command in place of the current (child) process.
+   @param args Null terminated list of arguments (including program).
+*/
+void lsh_exec(char **args)
+{
+	if (args[0] == NULL)
+		exit(EXIT_SUCCESS);
+
+	// Builtins run right here; the stage is already its own process.
+	int j = lsh_find_builtin(args[0]);
+	if (j >= 0) {
+		(*lsh_builtins[j].func)(args);
+		lsh_out_flush();
+		exit(EXIT_SUCCESS);
+	}
+
+	execvp(args[0], args);
+	perror("lsh");
+	exit(EXIT_FAILURE);
+}
+
+/*
+  Pipe capacity for pipelines, set with "set pipesize=SIZE".  0 keeps the
+  kernel default (64K on Linux); larger pipes let a fast producer run ahead
+  of a slow consumer without a context switch every 64K.
+*/
+size_t lsh_pipesize;
+
+/**
+   @brief Create a close-on-exec pipe with the configured capacity.
+   @param pfd Where to store the read and write ends.
+   @return 0 on success, -1 on error.
+*/
+int lsh_pipe(int pfd[2])
+{
+	if (pipe2(pfd, O_CLOEXEC) < 0)
+		return -1;
+	if (lsh_pipesize > 0)
+		// Best effort: the size was checked when it was set.
+		fcntl(pfd[1], F_SETPIPE_SZ, (int) lsh_pipesize);
+	return 0;
+}
+
+/**
+   @brief Bultin command: set
+   @param args List of args.  args[0] is "set".  Each remaining arg is an
+   option assignment "name=value"; no arguments lists the options.
+   Supported: pipesize=SIZE (0 for the kernel default).
+   @return Always returns 1, to continue executing.
+*/
+int lsh_set(char **args)
+{
+	int pfd[2];
+	size_t size;
+
+	if (args[1] == NULL) {
+		lsh_out_str("pipesize=");
+		lsh_out_uint(lsh_pipesize);
+		lsh_out_char('\n');
+		return 1;
+	}
+	for (int i = 1; args[i] != NULL; i++) {
+		if (strncmp(args[i], "pipesize=", 9) != 0) {
+			fprintf(stderr, "lsh: set: unknown option %s\n", args[i]);
+			continue;
+		}
+		if (strcmp(args[i] + 9, "0") == 0) {
+			lsh_pipesize = 0;
+			continue;
+		}
+		if (lsh_parse_size(args[i] + 9, &size) != 0 || size > INT_MAX) {
+			fprintf(stderr, "lsh: set: invalid pipe size %s\n", args[i] + 9);
+			continue;
+		}
+		// Try it once here, so a size over the system limit is reported now.
+		if (pipe(pfd) == 0) {
+			if (fcntl(pfd[1], F_SETPIPE_SZ, (int) size) < 0)
+				perror("lsh: set: pipesize");
+			else
+				lsh_pipesize = size;
+			close(pfd[0]);
+			close(pfd[1]);
+		}
+	}
+	return 1;
+}
+
+/**
+   @brief Start one stage of a pipeline without waiting for it.
+   @param stage Null terminated list of arguments of the stage.
+   @param fd Descriptors for the stage's stdin, stdout and stderr (the
+   pipes on either side, or redirected files), -1 to inherit.
+   @param spare Read end of the next pipe, which the stage must not hold.
+   @return The stage's pid, or -1 if it could not be started.
+*/
+pid_t lsh_launch_stage(char **stage, const int fd[3], int spare)
+{
+	pid_t pid;
+
+	if (stage[0] != NULL && lsh_find_builtin(stage[0]) < 0)
+		// External program: hand it to the launch backend
+		return lsh_spawn(stage, fd);
+
+	// Builtins need a process of their own to run shell code in.
+	if (lsh_trace_fp)
+		fflush(lsh_trace_fp);
+	long long t0 = lsh_trace_begin();
+	pid = fork();
+	if (pid == 0) {
+		// Child Process
+		lsh_trace_fp = NULL;
+		signal(SIGPIPE, SIG_DFL);
+		for (int i = 0; i < 3; i++) {
+			if (fd[i] >= 0) {
+				dup2(fd[i], i);
+				close(fd[i]);
+			}
+		}
+		if (spare >= 0)
+			close(spare);
+		lsh_exec(stage);
+	} else if (pid < 0) {
+		perror("lsh");
+	}
+	lsh_trace_end("fork", t0, stage[0]);
+	return pid;
+}
+
+/*
+  Background jobs.  "cmd &" starts a pipeline without waiting for it and
+  records it in the job table.  SIGCHLD only raises a flag; the children
+  are then reaped with waitpid(WNOHANG) before the next prompt, or picked
+  up by whatever wait the shell is blocked in, so the shell itself never
+  blocks on a background job unless asked to with wait or fg.
+*/
+struct lsh_job {
+	int id;
+	char *cmd;
+	pid_t *pid;	// one per stage, 0 once reaped
+	int npid;
+	int nlive;
+	int status;	// of the last stage
+};
+
+struct lsh_job *lsh_jobs;
+int lsh_njobs;
+int lsh_jobs_verbose;	// announce new jobs; set for a person at a prompt
+volatile sig_atomic_t lsh_sigchld;
+
+/**
+   @brief SIGCHLD handler: note that some child changed state.
+*/
+void lsh_sigchld_handler(int sig)
+{
+	(void) sig;
+	lsh_sigchld = 1;
+}
+
+/**
+   @brief Install the SIGCHLD handler, once.  Nothing runs in the background
+   before the first "&", so a shell that never sees one never pays for it.
+*/
+void lsh_sigchld_install(void)
+{
+	static int installed;
+	struct sigaction sa;
+
+	if (installed)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = lsh_sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+	installed = 1;
+}
+
+/**
+   @brief Record a reaped child against the job it belongs to.
+   @param pid The child.
+   @param status Its wait status.
+   @return 1 if it was part of a background job, 0 otherwise.
+*/
+int lsh_job_reaped(pid_t pid, int status)
+{
+	for (int i = 0; i < lsh_njobs; i++) {
+		struct lsh_job *job = &lsh_jobs[i];
+		for (int j = 0; j < job->npid; j++) {
+			if (job->pid[j] == pid) {
+				job->pid[j] = 0;
+				job->nlive--;
+				if (j == job->npid - 1)
+					job->status = status;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+   @brief Reap whatever background children have finished, without blocking.
+*/
+void lsh_jobs_poll(void)
+{
+	pid_t pid;
+	int status;
+
+	if (!lsh_sigchld)
+		return;
+	lsh_sigchld = 0;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		lsh_job_reaped(pid, status);
+}
+
+/**
+   @brief Drop finished jobs from the table.
+   @param verbose Whether to tell the user about each one.
+*/
+void lsh_jobs_report(int verbose)
+{
+	int i, n = 0;
+
+	for (i = 0; i < lsh_njobs; i++) {
+		struct lsh_job *job = &lsh_jobs[i];
+		if (job->nlive > 0) {
+			lsh_jobs[n++] = *job;
+			continue;
+		}
+		if (verbose)
+			fprintf(stderr, "[%d]  Done\t%s\n", job->id, job->cmd);
+		free(job->cmd);
+		free(job->pid);
+	}
+	lsh_njobs = n;
+}
+
+/**
+   @brief Add a started pipeline to the job table.
+   @param cmd The command it runs.
+   @param pid Its stage pids; the table takes ownership.
+   @param npid Number of stages.
+*/
+void lsh_job_add(struct lsh_cmd *cmd, pid_t *pid, int npid)
+{
+	struct lsh_job *job;
+	size_t len = 0;
+	int i, j, id = 1;
+	char **w;
+
+	for (i = 0; i < lsh_njobs; i++) {
+		if (lsh_jobs[i].id >= id)
+			id = lsh_jobs[i].id + 1;
+	}
+	lsh_jobs = realloc(lsh_jobs, (lsh_njobs + 1) * sizeof(struct lsh_job));
+	if (!lsh_jobs) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	job = &lsh_jobs[lsh_njobs++];
+	job->id = id;
+	job->pid = pid;
+	job->npid = npid;
+	job->nlive = 0;
+	job->status = 0;
+	for (i = 0; i < npid; i++)
+		job->nlive += pid[i] > 0;
+
+	// Rebuild a printable command line from the stages.
+	for (i = 0; i < cmd->nstage; i++)
+		for (w = cmd->argv + cmd->stage[i]; *w != NULL; w++)
+			len += strlen(*w) + 3;
+	if (!(job->cmd = malloc(len + 1))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	job->cmd[0] = '\0';
+	for (i = 0; i < cmd->nstage; i++) {
+		if (i > 0)
+			strcat(job->cmd, " | ");
+		for (j = 0, w = cmd->argv + cmd->stage[i]; *w != NULL; w++, j++) {
+			if (j > 0)
+				strcat(job->cmd, " ");
+			strcat(job->cmd, *w);
+		}
+	}
+	// Kept out of stdout, which may be a script's output.
+	if (lsh_jobs_verbose)
+		fprintf(stderr, "[%d] %d\n", id, (int) pid[npid - 1]);
+}
+
+/**
+   @brief Find a job from a "%n" or plain number argument.
+   @param arg The argument, or NULL for the most recent job.
+   @return The job, or NULL if there is no such job (already reported).
+*/
+struct lsh_job *lsh_job_find(const char *arg)
+{
+	int id;
+
+	if (arg == NULL) {
+		if (lsh_njobs > 0)
+			return &lsh_jobs[lsh_njobs - 1];
+		fprintf(stderr, "lsh: no current job\n");
+		return NULL;
+	}
+	id = atoi(arg[0] == '%' ? arg + 1 : arg);
+	for (int i = 0; i < lsh_njobs; i++) {
+		if (lsh_jobs[i].id == id)
+			return &lsh_jobs[i];
+	}
+	fprintf(stderr, "lsh: %s: no such job\n", arg);
+	return NULL;
+}
+
+/**
+   @brief Block until every process of a job has been reaped.
+*/
+void lsh_job_wait(struct lsh_job *job)
+{
+	pid_t pid;
+	int status;
+
+	while (job->nlive > 0) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			// Nothing left to wait for: someone else reaped them.
+			job->nlive = 0;
+			break;
+		}
+		lsh_job_reaped(pid, status);
+	}
+}
+
+/**
+   @brief Bultin command: jobs
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_jobs_cmd(char **args)
+{
+	(void) args;
+	lsh_jobs_poll();
+	for (int i = 0; i < lsh_njobs; i++) {
+		lsh_out_char('[');
+		lsh_out_uint(lsh_jobs[i].id);
+		lsh_out_str(lsh_jobs[i].nlive > 0 ? "]  Running\t" : "]  Done\t");
+		lsh_out_str(lsh_jobs[i].cmd);
+		lsh_out_char('\n');
+	}
+	lsh_jobs_report(0);
+	return 1;
+}
+
+/**
+   @brief Bultin command: wait
+   @param args List of args.  args[0] is "wait".  The remaining args name
+   jobs ("%n") to wait for; with none, waits for every job.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_wait(char **args)
+{
+	struct lsh_job *job;
+
+	if (args[1] == NULL) {
+		for (int i = 0; i < lsh_njobs; i++)
+			lsh_job_wait(&lsh_jobs[i]);
+	}
+	for (int i = 1; args[i] != NULL; i++) {
+		if ((job = lsh_job_find(args[i])) != NULL)
+			lsh_job_wait(job);
+	}
+	lsh_jobs_report(0);
+	return 1;
+}
+
+/**
+   @brief Bultin command: fg
+   @param args List of args.  args[0] is "fg".  args[1] is the job ("%n"),
+   the most recent one if missing.  The shell does not hand over the
+   terminal; fg prints the job and waits for it.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_fg(char **args)
+{
+	struct lsh_job *job = lsh_job_find(args[1]);
+
+	if (job == NULL)
+		return 1;
+	lsh_out_str(job->cmd);
+	lsh_out_char('\n');
+	lsh_out_flush();
+	lsh_job_wait(job);
+	lsh_jobs_report(0);
+	return 1;
+}
+
+/*
+  Coprocesses.  "coproc [-n NAME] cmd args..." starts cmd with a pipe on
+  its stdin and one on its stdout and leaves it running, so a filter that
+  is called over and over is started once instead of once per call.  The
+  shell's ends of the pipes go in $NAME_IN (what cmd reads) and $NAME_OUT
+  (what cmd writes), for use with >&, <& and 2>&:
+
+      coproc -n JQ jq -c --unbuffered .
+      echo '{"a": 1}' >&$JQ_IN
+      head -n 1 <&$JQ_OUT
+
+  NAME defaults to COPROC.  "coproc -c [NAME]" closes $NAME_IN, which
+  sends cmd EOF; $NAME_OUT stays open for what cmd still has to say, until
+  a second -c or a new coprocess of that name.  The process itself is an
+  ordinary job.
+*/
+struct lsh_coproc {
+	char *name;
+	pid_t pid;
+	int in;		// write end of cmd's stdin, -1 once closed
+	int out;	// read end of cmd's stdout
+};
+
+struct lsh_coproc *lsh_coprocs;
+int lsh_ncoprocs;
+
+/**
+   @brief Set $NAME_SUFFIX to a number.
+   @param name Coprocess name.
+   @param suffix "_IN", "_OUT" or "_PID".
+   @param value The number, or -1 to unset the variable.
+*/
+void lsh_coproc_var(const char *name, const char *suffix, int value)
+{
+	char var[256], num[16];
+	int len = snprintf(var, sizeof(var), "%s%s", name, suffix);
+
+	if (value < 0)
+		lsh_var_unset(var);
+	else
+		lsh_var_set(var, len, num, snprintf(num, sizeof(num), "%d", value), 0);
+}
+
+/**
+   @brief Close a coprocess' input or, if that is closed, forget it.
+   @param i Its index in lsh_coprocs.
+*/
+void lsh_coproc_close(int i)
+{
+	struct lsh_coproc *co = &lsh_coprocs[i];
+
+	if (co->in >= 0) {
+		close(co->in);
+		co->in = -1;
+		lsh_coproc_var(co->name, "_IN", -1);
+		return;
+	}
+	close(co->out);
+	lsh_coproc_var(co->name, "_OUT", -1);
+	lsh_coproc_var(co->name, "_PID", -1);
+	free(co->name);
+	lsh_coprocs[i] = lsh_coprocs[--lsh_ncoprocs];
+}
+
+/**
+   @brief Bultin command: coproc
+   @param args List of args.  args[0] is "coproc".  Either "-c [NAME]" to
+   close a coprocess, or "[-n NAME] cmd args..." to start one.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_coproc_cmd(char **args)
+{
+	const char *name = "COPROC";
+	struct lsh_cmd job = { 0 };
+	int in[2], out[2], i, stage = 0;
+	char **cmd = args + 1;
+	pid_t *pid;
+
+	if (cmd[0] != NULL && strcmp(cmd[0], "-c") == 0) {
+		if (cmd[1] != NULL)
+			name = cmd[1];
+		for (i = 0; i < lsh_ncoprocs; i++) {
+			if (strcmp(lsh_coprocs[i].name, name) == 0) {
+				lsh_coproc_close(i);
+				return 1;
+			}
+		}
+		fprintf(stderr, "lsh: coproc: %s: no such coprocess\n", name);
+		return 1;
+	}
+	if (cmd[0] != NULL && strcmp(cmd[0], "-n") == 0) {
+		if (cmd[1] == NULL || lsh_var_namelen(cmd[1]) != strlen(cmd[1]) ||
+		    strlen(cmd[1]) > 200) {
+			fprintf(stderr, "lsh: coproc: -n needs a variable name\n");
+			return 1;
+		}
+		name = cmd[1];
+		cmd += 2;
+	}
+	if (cmd[0] == NULL) {
+		fprintf(stderr, "lsh: coproc: expected a command\n");
+		return 1;
+	}
+	for (i = 0; i < lsh_ncoprocs; i++) {
+		if (strcmp(lsh_coprocs[i].name, name) != 0)
+			continue;
+		if (lsh_coprocs[i].in >= 0) {
+			fprintf(stderr, "lsh: coproc: %s: already running\n", name);
+			return 1;
+		}
+		// Its input is closed: drop what is left of the old one.
+		lsh_coproc_close(i);
+		break;
+	}
+
+	// The same pipes and launch path as a pipeline stage.
+	if (lsh_pipe(in) < 0) {
+		perror("lsh: coproc");
+		return 1;
+	}
+	if (lsh_pipe(out) < 0) {
+		perror("lsh: coproc");
+		close(in[0]);
+		close(in[1]);
+		return 1;
+	}
+	lsh_sigchld_install();
+	lsh_out_flush();
+	int fd[3] = { in[0], out[1], -1 };
+	if (!(pid = malloc(sizeof(pid_t)))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// A builtin run in a fork must not keep its own stdin open for writing.
+	*pid = lsh_launch_stage(cmd, fd, in[1]);
+	close(in[0]);
+	close(out[1]);
+	if (*pid < 0) {
+		close(in[1]);
+		close(out[0]);
+		free(pid);
+		return 1;
+	}
+
+	lsh_coprocs = realloc(lsh_coprocs, (lsh_ncoprocs + 1) * sizeof(struct lsh_coproc));
+	if (!lsh_coprocs || !(lsh_coprocs[lsh_ncoprocs].name = strdup(name))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	lsh_coprocs[lsh_ncoprocs].pid = *pid;
+	lsh_coprocs[lsh_ncoprocs].in = in[1];
+	lsh_coprocs[lsh_ncoprocs].out = out[0];
+	lsh_ncoprocs++;
+	lsh_coproc_var(name, "_IN", in[1]);
+	lsh_coproc_var(name, "_OUT", out[0]);
+	lsh_coproc_var(name, "_PID", *pid);
+
+	job.argv = cmd;
+	job.stage = &stage;
+	job.nstage = 1;
+	lsh_job_add(&job, pid, 1);
+	return 1;
+}
+
+/*
+  Parallel fan-out.  "parallel -j N cmd args..." reads one input per line
+  from stdin and runs cmd once per input, with "{}" in the args replaced by
+  the input (or the input appended if there is no "{}"), keeping N jobs
+  running.  Completion is seen through epoll on each job's output pipe and
+  pidfd; each job's output is collected whole and written in one go when it
+  finishes, so output from different jobs never interleaves.
+*/
+#define LSH_PAR_READSIZE (64 * 1024)
+
+struct lsh_par_job {
+	pid_t pid;	// 0 if the slot is free
+	int out;	// read end of the job's stdout, -1 once at EOF
+	int pidfd;	// -1 once reaped, or if pidfds are not supported
+	int reaped;
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+/**
+   @brief Build the argv for one input: "{}" becomes the input.
+   @param tmpl Command template.
+   @param input The input line.
+   @return Newly allocated argv; free it with lsh_par_free_argv().
+*/
+char **lsh_par_argv(char **tmpl, const char *input)
+{
+	int n, i, used = 0;
+	char **argv, *hole;
+
+	for (n = 0; tmpl[n] != NULL; n++)
+		;
+	if (!(argv = calloc(n + 2, sizeof(char *)))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++) {
+		size_t len = strlen(tmpl[i]) + 1;
+		for (hole = tmpl[i]; (hole = strstr(hole, "{}")) != NULL; hole += 2)
+			len += strlen(input);
+		if (!(argv[i] = malloc(len))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		argv[i][0] = '\0';
+		const char *p = tmpl[i];
+		while ((hole = strstr(p, "{}")) != NULL) {
+			strncat(argv[i], p, hole - p);
+			strcat(argv[i], input);
+			p = hole + 2;
+			used = 1;
+		}
+		strcat(argv[i], p);
+	}
+	if (!used && !(argv[n] = strdup(input))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	return argv;
+}
+
+/**
+   @brief Free an argv built by lsh_par_argv().
+*/
+void lsh_par_free_argv(char **argv)
+{
+	for (int i = 0; argv[i] != NULL; i++)
+		free(argv[i]);
+	free(argv);
+}
+
+/**
+   @brief Start one job in a free slot.
+   @return 0 on success, -1 if it could not be started.
+*/
+int lsh_par_start(struct lsh_par_job *job, int slot, int ep, int devnull,
+                  char **tmpl, const char *input)
+{
+	struct epoll_event ev;
+	char **argv = lsh_par_argv(tmpl, input);
+	int pfd[2];
+
+	if (lsh_pipe(pfd) < 0) {
+		perror("lsh: parallel");
+		lsh_par_free_argv(argv);
+		return -1;
+	}
+	int fd[3] = { devnull, pfd[1], -1 };
+	job->pid = lsh_launch_stage(argv, fd, pfd[0]);
+	close(pfd[1]);
+	lsh_par_free_argv(argv);
+	if (job->pid <= 0) {
+		job->pid = 0;
+		close(pfd[0]);
+		return -1;
+	}
+	job->out = pfd[0];
+	job->len = 0;
+	job->reaped = 0;
+
+	// Events carry the slot, and which of its two descriptors fired.
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t) slot << 1;
+	epoll_ctl(ep, EPOLL_CTL_ADD, job->out, &ev);
+	job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+	if (job->pidfd >= 0) {
+		ev.data.u64 = (uint64_t) slot << 1 | 1;
+		epoll_ctl(ep, EPOLL_CTL_ADD, job->pidfd, &ev);
+	}
+	return 0;
+}
+
+/**
+   @brief Bultin command: parallel
+   @param args List of args.  args[0] is "parallel".  "-j N" sets the number
+   of concurrent jobs (default: number of CPUs); the rest is the command.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_parallel(char **args)
+{
+	struct lsh_lines in = { { NULL, 0, 0 }, NULL, 0, 0, 0, 0 };
+	struct lsh_par_job *job;
+	struct epoll_event ev[16];
+	size_t next = 0;
+	int njobs = sysconf(_SC_NPROCESSORS_ONLN), running = 0, i = 1, n, ep, devnull;
+	int status;
+
+	if (args[i] != NULL && strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+		njobs = atoi(args[i + 1]);
+		i += 2;
+	} else if (args[i] != NULL && strncmp(args[i], "-j", 2) == 0 && args[i][2] != '\0') {
+		njobs = atoi(args[i] + 2);
+		i++;
+	}
+	if (njobs < 1 || args[i] == NULL) {
+		fprintf(stderr, "lsh: usage: parallel [-j N] command [args...]\n");
+		return 1;
+	}
+
+	// Inputs come in through the same line reader sort uses.
+	while (lsh_lines_read(&in, 0) > 0)
+		;
+	// Terminate each input in place; the last read left the arena room.
+	for (size_t k = 0; k < in.n; k++)
+		in.arena.buf[in.line[k].off + in.line[k].len] = '\0';
+
+	job = calloc(njobs, sizeof(*job));
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (!job || ep < 0) {
+		fprintf(stderr, "lsh: parallel: %s\n", job ? strerror(errno) : "allocation error");
+		exit(EXIT_FAILURE);
+	}
+	lsh_out_flush();
+
+	while (next < in.n || running > 0) {
+		// Fill every free slot.
+		for (int s = 0; s < njobs && next < in.n; s++) {
+			if (job[s].pid != 0)
+				continue;
+			if (lsh_par_start(&job[s], s, ep, devnull, args + i,
+			                  in.arena.buf + in.line[next++].off) == 0)
+				running++;
+		}
+		if (running == 0)
+			continue;
+
+		n = epoll_wait(ep, ev, 16, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("lsh: parallel");
+			break;
+		}
+		for (int e = 0; e < n; e++) {
+			struct lsh_par_job *j = &job[ev[e].data.u64 >> 1];
+			if (ev[e].data.u64 & 1) {
+				// pidfd readable: the job has exited.
+				waitpid(j->pid, &status, 0);
+				j->reaped = 1;
+				close(j->pidfd);
+				j->pidfd = -1;
+			} else {
+				if (j->cap - j->len < LSH_PAR_READSIZE) {
+					j->cap = j->cap ? j->cap * 2 : LSH_PAR_READSIZE;
+					if (!(j->buf = realloc(j->buf, j->cap))) {
+						fprintf(stderr, "lsh: allocation error\n");
+						exit(EXIT_FAILURE);
+					}
+				}
+				ssize_t r = read(j->out, j->buf + j->len, j->cap - j->len);
+				if (r > 0) {
+					j->len += r;
+				} else if (r == 0 || errno != EINTR) {
+					close(j->out);
+					j->out = -1;
+				}
+			}
+			if (j->pid != 0 && j->out < 0 && j->pidfd < 0) {
+				// Without a pidfd, output EOF is the best sign we get.
+				if (!j->reaped)
+					waitpid(j->pid, &status, 0);
+				// Done: emit its output as one block and free the slot.
+				lsh_write_all(1, j->buf, j->len);
+				j->pid = 0;
+				running--;
+			}
+		}
+	}
+
+	for (int s = 0; s < njobs; s++)
+		free(job[s].buf);
+	free(job);
+	close(ep);
+	if (devnull >= 0)
+		close(devnull);
+	lsh_lines_free(&in);
+	return 1;
+}
+
+/**
+   @brief Number of lines a "head" stage keeps, so that a sort feeding it
+   can stop there.
+   @param stage Words of the stage.
+   @return K for "head", "head -n K" or "head -nK" on stdin, 0 otherwise.
+*/
+size_t lsh_head_count(char **stage)
+{
+	const char *count = "10";
+	int n = 0;
+
+	while (stage[n] != NULL && !lsh_is_op(stage[n]))
+		n++;
+	if (n == 0 || strcmp(stage[0], "head") != 0)
+		return 0;
+	if (n == 3 && strcmp(stage[1], "-n") == 0)
+		count = stage[2];
+	else if (n == 2 && strncmp(stage[1], "-n", 2) == 0)
+		count = stage[1] + 2;
+	else if (n != 1)
+		return 0;
+	if (count[strspn(count, "0123456789")] != '\0')
+		return 0;
+	return strtoul(count, NULL, 10);
+}
+
+/**
+   @brief Execute shell built-in or launch program.
+   @param cmd The lexed command line.
+   @return 1 if the shell should continue running, 0 if it should terminate
+*/
+int lsh_execute(struct lsh_cmd *cmd)
+{
+	char **args = cmd->argv + cmd->stage[0], **stage;
+	int in = -1, pfd[2], status, nchild = 0, i;
+	struct lsh_stage_stat *st = NULL;
+	struct rusage ru;
+	pid_t pid, *pids;
+
+	if (args[0] == NULL && cmd->nstage == 1) {
+		// An empty command was entered.
+		return 1;
+	}
+	if (args[0] != NULL && strcmp(args[0], "time") == 0) {
+		// Time the whole pipeline, not just its first stage.
+		int saved = lsh_profile;
+		lsh_profile = 1;
+		cmd->stage[0]++;
+		status = lsh_execute(cmd);
+		cmd->stage[0]--;
+		lsh_profile = saved;
+		return status;
+	}
+
+	if (cmd->nstage == 1 && !cmd->background) {
+		// No pipe: builtins run in the shell, programs get one fork
+		int fd[3] = { -1, -1, -1 }, opened[3];
+		if (!(args = lsh_redirect(args, fd, opened)))
+			return 1;
+		status = lsh_launch(args, fd);
+		lsh_redirect_close(opened);
+		return status;
+	}
+
+	// Start the stages left to right.  Only the pipes on either side of the
+	// current stage are open at any time, so any number of stages works.
+	pids = calloc(cmd->nstage, sizeof(pid_t));
+	if (lsh_profile && !cmd->background)
+		st = calloc(cmd->nstage, sizeof(*st));
+	if (!pids || (lsh_profile && !cmd->background && !st)) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (cmd->background)
+		lsh_sigchld_install();
+	lsh_out_flush();
+	for (i = 0; i < cmd->nstage; i++) {
+		stage = cmd->argv + cmd->stage[i];
+		pfd[0] = pfd[1] = -1;
+		if (i + 1 < cmd->nstage) {
+			// Pipe created, kept out of spawned programs
+			if (lsh_pipe(pfd) < 0) {
+				perror("lsh");
+				break;
+			}
+		}
+		if (st) {
+			st[i].name = stage[0];
+			clock_gettime(CLOCK_MONOTONIC, &st[i].start);
+		}
+		int fd[3] = { in, pfd[1], -1 }, opened[3];
+		pid = -1;
+		if ((stage = lsh_redirect(stage, fd, opened)) != NULL) {
+			// "sort | head -n K" only needs the top K lines sorted.
+			if (fd[1] == pfd[1] && pfd[1] >= 0 && stage[0] != NULL &&
+			    strcmp(stage[0], "sort") == 0)
+				lsh_sort_top_hint = lsh_head_count(cmd->argv + cmd->stage[i + 1]);
+			pid = lsh_launch_stage(stage, fd, pfd[0]);
+			lsh_sort_top_hint = 0;
+			lsh_redirect_close(opened);
+		}
+		if (pid > 0)
+			nchild++;
+		pids[i] = pid;
+
+		// Parent Process
+		// Close used pipes
+		if (in >= 0)
+			close(in);
+		if (pfd[1] >= 0)
+			close(pfd[1]);
+		in = pfd[0];
+	}
+	if (in >= 0)
+		close(in);
+
+	if (cmd->background) {
+		// Leave it running; the job table owns the pids now.
+		lsh_job_add(cmd, pids, cmd->nstage);
+		return 1;
+	}
+
+	long long t0 = lsh_trace_begin();
+	while (nchild > 0) {
+		pid = wait4(-1, &status, 0, &ru);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < cmd->nstage && pids[i] != pid; i++)
+			;
+		if (i == cmd->nstage) {
+			// A background job finished meanwhile.
+			lsh_job_reaped(pid, status);
+			continue;
+		}
+		nchild--;
+		if (st) {
+			clock_gettime(CLOCK_MONOTONIC, &st[i].end);
+			st[i].pid = pid;
+			st[i].ru = ru;
+		}
+	}
+	lsh_trace_end("wait", t0, args[0]);
+	if (st) {
+		lsh_profile_report(st, cmd->nstage);
+		free(st);
+	}
+	free(pids);
+	return 1;
+}
+
+#define LSH_RL_READSIZE (64 * 1024)
+/*
+  Block-buffered input.  Input is read in large chunks and each line is
+  handed out as a slice of the buffer, so the buffer is the only
+  allocation and it lives for the whole session.
+
+  Commands read from stdin too, so when the script itself comes in on
+  stdin, a command that inherits it must find it just past its own line,
+  not wherever the read-ahead got to:
+  - a seekable stdin is read with pread() and seeked to the end of the
+    current line before such a command;
+  - a pipe is looked at with tee(), which copies without consuming, and
+    only what has been handed out is read off it for real before such a
+    command;
+  - anything else that cannot seek (a socket) is read a byte at a time,
+    as sh does.
+  A terminal hands out one line per read() anyway.  After a command that
+  inherited stdin the read-ahead is dropped if it can have gone stale.
+*/
+struct lsh_reader {
+	int fd;
+	char *buf;
+	size_t start;	// first byte not yet handed out
+	size_t scan;	// bytes before this are known to hold no newline
+	size_t end;	// end of valid data
+	size_t cap;
+	int eof;
+	int seekable;	// stdin, seeked to each command's input
+	int piped;	// stdin pipe, peeked at through peek[]
+	int bytewise;	// stdin that cannot seek: no read-ahead at all
+	off_t offset;	// stream offset of buf[end], if seekable or piped
+	off_t removed;	// bytes read off the pipe for real, if piped
+	int peek[2];	// private pipe tee() copies into
+};
+
+/**
+   @brief Read bytes already seen through tee() off the stdin pipe.
+   @param in The reader.
+   @param upto Stream offset to consume up to.
+*/
+void lsh_reader_drain(struct lsh_reader *in, off_t upto)
+{
+	char scratch[4096];
+	size_t want;
+	ssize_t n;
+
+	while (in->removed < upto) {
+		want = upto - in->removed < (off_t) sizeof(scratch) ?
+			(size_t) (upto - in->removed) : sizeof(scratch);
+		n = read(in->fd, scratch, want);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		in->removed += n;
+	}
+}
+
+/**
+   @brief Copy what the stdin pipe holds into the buffer without taking
+   it off the pipe.
+   @param in The reader; everything peeked before has been drained.
+   @param len Room in the buffer.
+   @return Bytes copied, 0 at end of input, -1 on error.
+*/
+ssize_t lsh_reader_peek(struct lsh_reader *in, size_t len)
+{
+	ssize_t n, got = 0, r;
+
+	if ((n = tee(in->fd, in->peek[1], len, 0)) <= 0)
+		return n;
+	while (got < n) {
+		r = read(in->peek[0], in->buf + in->end + got, n - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		got += r;
+	}
+	return n;
+}
+
+/**
+   @brief Read a line of input.
+   @param in Reader to take the line from.
+   @return The line, valid until the next call.
+*/
+char *lsh_read_line(struct lsh_reader *in)
+{
+	char *nl, *line;
+	ssize_t n;
+
+	while (1) {
+		nl = memchr(in->buf + in->scan, '\n', in->end - in->scan);
+		if (nl) {
+			*nl = '\0';
+			line = in->buf + in->start;
+			in->start = in->scan = nl + 1 - in->buf;
+			return line;
+		}
+		in->scan = in->end;
+
+		if (in->eof) {
+			if (in->start == in->end)
+				exit(EXIT_SUCCESS);
+			// Last line had no newline.
+			in->buf[in->end] = '\0';
+			line = in->buf + in->start;
+			in->start = in->scan = in->end;
+			return line;
+		}
+
+		// Move the partial line to the front, then grow if still full.
+		if (in->start > 0) {
+			memmove(in->buf, in->buf + in->start, in->end - in->start);
+			in->end -= in->start;
+			in->scan -= in->start;
+			in->start = 0;
+		}
+		if (in->cap - in->end < LSH_RL_READSIZE / 2) {
+			in->cap = in->cap ? in->cap * 2 : LSH_RL_READSIZE;
+			in->buf = realloc(in->buf, in->cap);
+			if (!in->buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		// Keep a byte spare for the terminator of an unterminated last line.
+		if (in->seekable) {
+			// pread() leaves the file offset where commands expect it.
+			n = pread(in->fd, in->buf + in->end, in->cap - in->end - 1, in->offset);
+		} else if (in->piped) {
+			// All that was peeked belongs to the line being put together,
+			// and tee() always starts at the front of the pipe.
+			lsh_reader_drain(in, in->offset);
+			n = lsh_reader_peek(in, in->cap - in->end - 1);
+		} else {
+			n = read(in->fd, in->buf + in->end,
+			         in->bytewise ? 1 : in->cap - in->end - 1);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("lsh");
+			in->eof = 1;
+		} else if (n == 0) {
+			in->eof = 1;
+		} else {
+			in->end += n;
+			in->offset += n;
+		}
+	}
+}
+
+/**
+   @brief Decide how much a reader may read ahead of the current line.
+   @param in The reader, reading from fd.
+*/
+void lsh_reader_init(struct lsh_reader *in)
+{
+	struct stat st;
+	off_t pos;
+
+	if (in->fd != STDIN_FILENO || isatty(STDIN_FILENO))
+		return;
+	if ((pos = lseek(in->fd, 0, SEEK_CUR)) >= 0) {
+		in->seekable = 1;
+		in->offset = pos;
+	} else if (fstat(in->fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+	           pipe2(in->peek, O_CLOEXEC) == 0) {
+		in->piped = 1;
+	} else {
+		in->bytewise = 1;
+	}
+}
+
+/**
+   @brief Put stdin where a command that inherits it expects it: just
+   past the current line, not at the end of the read-ahead.
+   @param in The reader.
+*/
+void lsh_reader_give(struct lsh_reader *in)
+{
+	off_t given = in->offset - (off_t) (in->end - in->start);
+
+	if (in->seekable)
+		lseek(in->fd, given, SEEK_SET);
+	else if (in->piped)
+		lsh_reader_drain(in, given);
+}
+
+/**
+   @brief Take stdin back after a command that inherited it.  If the
+   command may have read from it, the read-ahead is stale and is dropped.
+   @param in The reader.
+*/
+void lsh_reader_take(struct lsh_reader *in)
+{
+	off_t given = in->offset - (off_t) (in->end - in->start), pos;
+
+	if (in->seekable) {
+		pos = lseek(in->fd, 0, SEEK_CUR);
+		if (pos == given)
+			// Untouched: what is buffered is still what follows.
+			return;
+	} else if (in->piped) {
+		// A pipe cannot tell; the next line is peeked at again.
+		pos = given;
+	} else {
+		return;
+	}
+	in->start = in->scan = in->end = 0;
+	in->offset = pos;
+	in->eof = 0;
+}
+
+/*
+  Command line lexer.  One pass over the line splits it into words, handles
+  '...' and "..." quoting and backslash escapes, expands $NAME and ${NAME}
+  (outside '...'), and records where each pipeline stage starts.  Word
+  text is copied into an arena owned by the lsh_cmd and reused for every
+  line, so once its buffers have grown to fit, lexing a line does not
+  allocate.
+*/
+#define LSH_TOK_DELIM " \t\r\n\a"
+#define LSH_TOK_OPS "|<>&"
+
+/**
+   @brief Make sure argv has room for argv[n].
+*/
+void lsh_cmd_room(struct lsh_cmd *cmd, int n)
+{
+	if (n < cmd->argvcap)
+		return;
+	if (cmd->argvcap == 0)
+		cmd->argvcap = LSH_TOK_BUFSIZE;
+	while (n >= cmd->argvcap)
+		cmd->argvcap *= 2;
+	cmd->argv = realloc(cmd->argv, cmd->argvcap * sizeof(char *));
+	if (!cmd->argv) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+   @brief Record that a pipeline stage starts at argv[n].
+*/
+void lsh_cmd_stage(struct lsh_cmd *cmd, int n)
+{
+	if (cmd->nstage >= cmd->stagecap) {
+		cmd->stagecap = cmd->stagecap ? cmd->stagecap * 2 : LSH_TOK_BUFSIZE / 8;
+		cmd->stage = realloc(cmd->stage, cmd->stagecap * sizeof(int));
+		if (!cmd->stage) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	cmd->stage[cmd->nstage++] = n;
+}
+
+/**
+   @brief Expand a $NAME or ${NAME} reference into the word being lexed.
+   An unset variable expands to nothing; a '$' that starts no reference
+   is copied as it is.
+   @param cmd Command being lexed.  Its arena grows if the value does not
+   fit, and the n words in argv so far are moved along.
+   @param n Number of entries in argv so far.
+   @param p The '$'.
+   @param end End of the line.
+   @param out Write position in the arena.
+   @param word Start of the current word in the arena.
+   @return Where lexing continues.
+*/
+const char *lsh_split_expand(struct lsh_cmd *cmd, int n, const char *p,
+                             const char *end, char **out, char **word)
+{
+	const char *name = p + 1, *value;
+	size_t len, vlen, need;
+	int braced = *name == '{';
+
+	name += braced;
+	len = lsh_var_namelen(name);
+	if (len == 0 || (braced && name[len] != '}')) {
+		*(*out)++ = *p;
+		return p + 1;
+	}
+	p = name + len + braced;
+	if ((value = lsh_var_get(name, len)) == NULL)
+		return p;
+
+	// What is written so far, the value, and the rest of the line at most.
+	vlen = strlen(value);
+	need = (*out - cmd->text) + vlen + (end - p) + 1;
+	if (need > cmd->textcap) {
+		char *text;
+		size_t cap = cmd->textcap * 2;
+		while (cap < need)
+			cap *= 2;
+		if (!(text = malloc(cap))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(text, cmd->text, *out - cmd->text);
+		for (int i = 0; i < n; i++)
+			if (cmd->argv[i] != NULL && !lsh_is_op(cmd->argv[i]))
+				cmd->argv[i] = text + (cmd->argv[i] - cmd->text);
+		*word = text + (*word - cmd->text);
+		*out = text + (*out - cmd->text);
+		free(cmd->text);
+		cmd->text = text;
+		cmd->textcap = cap;
+	}
+	memcpy(*out, value, vlen);
+	*out += vlen;
+	return p;
+}
+
+/**
+   @brief Split a line into words and pipeline stages, in one pass.
+   @param cmd Where to store the result; its buffers are reused.
+   @param line The line.
+   @return 0 on success, -1 on a syntax error (already reported).
+*/
+int lsh_split_line(struct lsh_cmd *cmd, const char *line)
+{
+	size_t len = strlen(line);
+	const char *p = line;
+	char *out, *word;
+	int n = 0;
+
+	// A word never takes more room than its source text plus the delimiter
+	// after it, so only an expansion can make the arena move mid-line.
+	if (len + 1 > cmd->textcap) {
+		free(cmd->text);
+		cmd->textcap = len + 1 > LSH_RL_READSIZE ? len + 1 : LSH_RL_READSIZE;
+		if (!(cmd->text = malloc(cmd->textcap))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	out = cmd->text;
+	cmd->argc = 0;
+	cmd->nstage = 0;
+	cmd->background = 0;
+	lsh_cmd_stage(cmd, 0);
+
+	while (1) {
+		while (*p && strchr(LSH_TOK_DELIM, *p))
+			p++;
+		// A '#' at the start of a word comments out the rest of the line.
+		if (*p == '\0' || *p == '#')
+			break;
+
+		lsh_cmd_room(cmd, n);
+		if (*p == '|') {
+			// End of a stage: terminate its argv, start the next one.
+			cmd->argv[n++] = NULL;
+			lsh_cmd_stage(cmd, n);
+			p++;
+			continue;
+		} else if (*p == '<') {
+			cmd->argv[n++] = p[1] == '&' ? lsh_op_dupin : lsh_op_in;
+			p += p[1] == '&' ? 2 : 1;
+			continue;
+		} else if (*p == '>' && p[1] == '&') {
+			cmd->argv[n++] = lsh_op_dupout;
+			p += 2;
+			continue;
+		} else if (*p == '>') {
+			cmd->argv[n++] = p[1] == '>' ? lsh_op_append : lsh_op_out;
+			p += p[1] == '>' ? 2 : 1;
+			continue;
+		} else if (p[0] == '2' && p[1] == '>') {
+			cmd->argv[n++] = p[2] == '&' ? lsh_op_duperr : lsh_op_err;
+			p += p[2] == '&' ? 3 : 2;
+			continue;
+		} else if (*p == '&') {
+			// Run in the background; only allowed at the end of the line.
+			for (p++; *p && strchr(LSH_TOK_DELIM, *p); p++)
+				;
+			if (*p != '\0' && *p != '#') {
+				fprintf(stderr, "lsh: syntax error near '&'\n");
+				return -1;
+			}
+			cmd->background = 1;
+			break;
+		}
+
+		word = out;
+		while (*p && !strchr(LSH_TOK_DELIM LSH_TOK_OPS, *p)) {
+			if (*p == '\'') {
+				// Everything up to the closing quote is literal.
+				for (p++; *p && *p != '\''; )
+					*out++ = *p++;
+				if (*p++ != '\'')
+					goto unterminated;
+			} else if (*p == '"') {
+				// Backslash only escapes what is special inside quotes.
+				for (p++; *p && *p != '"'; ) {
+					if (*p == '$') {
+						p = lsh_split_expand(cmd, n, p, line + len, &out, &word);
+						continue;
+					}
+					if (*p == '\\' && p[1] && strchr("\"\\$`", p[1]))
+						p++;
+					*out++ = *p++;
+				}
+				if (*p++ != '"')
+					goto unterminated;
+			} else if (*p == '\\') {
+				if (*++p)
+					*out++ = *p++;
+			} else if (*p == '$') {
+				p = lsh_split_expand(cmd, n, p, line + len, &out, &word);
+			} else {
+				*out++ = *p++;
+			}
+		}
+		*out++ = '\0';
+		cmd->argv[n++] = word;
+		cmd->argc++;
+	}
+	lsh_cmd_room(cmd, n);
+	cmd->argv[n] = NULL;
+	cmd->textlen = out - cmd->text;
+	return 0;
+
+unterminated:
+	fprintf(stderr, "lsh: unterminated quote\n");
+	return -1;
+}
+
+
+/*
+  Parsed-command cache.  Scripts and loops feed the shell the same lines
+  over and over, so the lexed form of recent lines is kept in a small LRU
+  table keyed by the hash of the line.  A hit skips lsh_split_line()
+  entirely; the "cache" builtin shows the hit and miss counts.
+*/
+#define LSH_CACHE_SIZE 64
+
+struct lsh_cache_entry {
+	char *line;
+	size_t linecap;
+	unsigned int hash;
+	unsigned long stamp;	// last use, 0 if the slot is empty
+	struct lsh_cmd cmd;
+};
+
+struct lsh_cache_entry lsh_cache[LSH_CACHE_SIZE];
+unsigned long lsh_cache_clock, lsh_cache_hits, lsh_cache_misses;
+
+/**
+   @brief Find the lexed form of a line in the cache.
+   @param line The line.
+   @param hash lsh_hash_str() of the line.
+   @return The cached command, or NULL on a miss.
+*/
+struct lsh_cmd *lsh_cache_get(const char *line, unsigned int hash)
+{
+	for (int i = 0; i < LSH_CACHE_SIZE; i++) {
+		struct lsh_cache_entry *e = &lsh_cache[i];
+		if (e->stamp && e->hash == hash && strcmp(e->line, line) == 0) {
+			e->stamp = ++lsh_cache_clock;
+			lsh_cache_hits++;
+			return &e->cmd;
+		}
+	}
+	lsh_cache_misses++;
+	return NULL;
+}
+
+/**
+   @brief Copy a freshly lexed line into the least recently used slot.
+   @param line The line.
+   @param hash lsh_hash_str() of the line.
+   @param cmd Its lexed form.
+*/
+void lsh_cache_put(const char *line, unsigned int hash, struct lsh_cmd *cmd)
+{
+	struct lsh_cache_entry *e = &lsh_cache[0];
+	struct lsh_cmd *c;
+	size_t len = strlen(line) + 1;
+	int n = cmd->stage[cmd->nstage - 1], i;
+
+	for (i = 1; i < LSH_CACHE_SIZE; i++) {
+		if (lsh_cache[i].stamp < e->stamp)
+			e = &lsh_cache[i];
+	}
+
+	// Slots keep their buffers, so a warm cache does not allocate either.
+	if (len > e->linecap) {
+		free(e->line);
+		e->linecap = len;
+		if (!(e->line = malloc(len))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(e->line, line, len);
+	e->hash = hash;
+	e->stamp = ++lsh_cache_clock;
+
+	c = &e->cmd;
+	if (cmd->textlen > c->textcap) {
+		free(c->text);
+		c->textcap = cmd->textlen;
+		if (!(c->text = malloc(c->textcap))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(c->text, cmd->text, cmd->textlen);
+	c->textlen = cmd->textlen;
+
+	// Find the end of argv: the terminator of the last stage.
+	while (cmd->argv[n] != NULL)
+		n++;
+	lsh_cmd_room(c, n);
+	for (i = 0; i <= n; i++) {
+		char *w = cmd->argv[i];
+		// Words point into the arena; operators are static and stay put.
+		if (w != NULL && !lsh_is_op(w))
+			w = c->text + (w - cmd->text);
+		c->argv[i] = w;
+	}
+	c->argc = cmd->argc;
+	c->background = cmd->background;
+	if (cmd->nstage > c->stagecap) {
+		free(c->stage);
+		c->stagecap = cmd->stagecap;
+		if (!(c->stage = malloc(c->stagecap * sizeof(int)))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(c->stage, cmd->stage, cmd->nstage * sizeof(int));
+	c->nstage = cmd->nstage;
+}
+
+/**
+   @brief Bultin command: cache
+   @param args List of args.  args[0] is "cache".  "-r" empties the cache;
+   otherwise its hit and miss counts are printed.
+   @return Always returns 1, to continue executing.
+*/
+int lsh_cache_cmd(char **args)
+{
+	int i, used = 0;
+
+	if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+		for (i = 0; i < LSH_CACHE_SIZE; i++)
+			lsh_cache[i].stamp = 0;
+		lsh_cache_hits = lsh_cache_misses = 0;
+		return 1;
+	}
+	for (i = 0; i < LSH_CACHE_SIZE; i++)
+		used += lsh_cache[i].stamp != 0;
+	lsh_out_str("hits ");
+	lsh_out_uint(lsh_cache_hits);
+	lsh_out_str(" misses ");
+	lsh_out_uint(lsh_cache_misses);
+	lsh_out_str(" entries ");
+	lsh_out_uint(used);
+	lsh_out_char('/');
+	lsh_out_uint(LSH_CACHE_SIZE);
+	lsh_out_char('\n');
+	return 1;
+}
+
+/**
+   @brief Load a whole script into a reader.
+   @param in Reader to set up.
+   @param path Script to run.
+   @return 0 on success, -1 on error (already reported).
+*/
+int lsh_reader_open(struct lsh_reader *in, const char *path)
+{
+	struct stat st;
+	ssize_t n;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "lsh: %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		// Not a plain file (a fifo, say): stream it like stdin.
+		in->fd = fd;
+		return 0;
+	}
+
+	// One read for the whole file, plus room to terminate the last line.
+	in->cap = st.st_size + 1;
+	if (!(in->buf = malloc(in->cap))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	while (in->end < (size_t) st.st_size) {
+		n = read(fd, in->buf + in->end, st.st_size - in->end);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		in->end += n;
+	}
+	close(fd);
+	in->fd = -1;
+	in->eof = 1;
+	return 0;
+}
+
+/**
+   @brief Run the last command of a script or -c string by exec()ing it in
+   place of the shell, saving a fork and a wait, as dash does.  The shell's
+   exit status becomes the command's.
+   @param cmd The lexed command.  Returns without doing anything unless it
+   is a single external command and nothing needs the shell afterwards
+   (no background jobs, profiling or tracing).
+*/
+void lsh_execute_last(struct lsh_cmd *cmd)
+{
+	char **args = cmd->argv + cmd->stage[0];
+	int fd[3] = { -1, -1, -1 }, opened[3], i;
+
+	if (cmd->nstage != 1 || cmd->background || args[0] == NULL ||
+	    lsh_is_op(args[0]) || lsh_find_builtin(args[0]) >= 0 ||
+	    strchr(args[0], '=') != NULL ||
+	    lsh_njobs > 0 || lsh_profile || lsh_trace_fp != NULL)
+		return;
+	if (!(args = lsh_redirect(args, fd, opened)))
+		exit(EXIT_FAILURE);
+	if (args[0] == NULL)
+		exit(EXIT_SUCCESS);
+	lsh_out_flush();
+	for (i = 0; i < 3; i++)
+		if (fd[i] >= 0)
+			dup2(fd[i], i);
+	// One exec: filling the path cache first would only add lookups.
+	signal(SIGPIPE, SIG_DFL);
+	execvp(args[0], args);
+	perror("lsh");
+	exit(EXIT_FAILURE);
+}
+
+/**
+   @brief Tell whether a command may read the shell's own stdin.
+   @param cmd The lexed command.
+   @return 0 if its first stage has stdin redirected or is a builtin that
+   never reads it, 1 otherwise.
+*/
+int lsh_stdin_used(struct lsh_cmd *cmd)
+{
+	char **args = cmd->argv + cmd->stage[0];
+	int j;
+
+	for (int i = 0; args[i] != NULL; i++)
+		if (args[i] == lsh_op_in || args[i] == lsh_op_dupin)
+			return 0;
+	if (args[0] == NULL || lsh_is_op(args[0]) || strchr(args[0], '=') != NULL)
+		return 0;
+	if ((j = lsh_find_builtin(args[0])) < 0 || j >= LSH_NUM_BUILTINS)
+		// Programs and plugins may read anything.
+		return 1;
+	return strcmp(args[0], "sort") == 0 || strcmp(args[0], "parallel") == 0 ||
+	       strcmp(args[0], "time") == 0;
+}
+
+/**
+   @brief Loop getting input and executing it.
+   @param in Where the commands come from.
+   @param interactive Whether to print a prompt before each command.
+*/
+void lsh_loop(struct lsh_reader *in, int interactive)
+{
+	struct lsh_cmd cmd = { NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, 0 };
+	struct lsh_cmd *c;
+	unsigned int hash;
+	char *line;
+	int status = 1, cacheable, used;
+
+	lsh_jobs_verbose = interactive;
+	do {
+		lsh_jobs_poll();
+		lsh_jobs_report(interactive);
+		if (interactive) {
+			printf("shsh!%% ");
+			fflush(stdout);
+		}
+		long long t0 = lsh_trace_begin();
+		line = lsh_read_line(in);
+		lsh_trace_end("read_line", t0, NULL);
+		// A line that expands variables means something new each time.
+		cacheable = strchr(line, '$') == NULL;
+		hash = lsh_hash_str(line);
+		if (!cacheable || (c = lsh_cache_get(line, hash)) == NULL) {
+			t0 = lsh_trace_begin();
+			if (lsh_split_line(&cmd, line) < 0)
+				continue;
+			lsh_trace_end("split_line", t0, NULL);
+			if (cacheable)
+				lsh_cache_put(line, hash, &cmd);
+			c = &cmd;
+		}
+		used = lsh_stdin_used(c);
+		if (used)
+			lsh_reader_give(in);
+		if (!interactive && in->eof && in->start == in->end)
+			// Nothing follows: the shell may as well become the command.
+			lsh_execute_last(c);
+		status = lsh_execute(c);
+		if (used)
+			lsh_reader_take(in);
+	} while (status);
+	free(cmd.text);
+	free(cmd.argv);
+	free(cmd.stage);
+}
+
+/**
+   @brief Main entry point.
+   @param argc Argument count.
+   @param argv Argument vector.
+   @return status code
+*/
+int main(int argc, char **argv)
+{
+	struct lsh_reader in = { STDIN_FILENO, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, { -1, -1 } };
+	int i, interactive;
+
+	// Load config files, if any.
+	setenv("0", "- SHSH", 1);
+	setenv("SHELL", "- SHSH", 1);
+	lsh_spawn_init();
+	lsh_profile = getenv("SHSH_PROFILE") != NULL;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strncmp(argv[i], "--trace=", 8) == 0) {
+			lsh_trace_open(argv[i] + 8);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			// Run the string as a script held in memory.
+			in.fd = -1;
+			in.end = strlen(argv[++i]);
+			in.cap = in.end + 1;
+			in.buf = strdup(argv[i]);
+			in.eof = 1;
+			break;
+		} else {
+			fprintf(stderr, "usage: %s [--trace=FILE] [-c command | script]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (in.buf == NULL && i < argc && lsh_reader_open(&in, argv[i]) < 0)
+		return EXIT_FAILURE;
+
+	// Only prompt when a person is typing the commands.
+	interactive = in.fd == STDIN_FILENO && isatty(STDIN_FILENO);
+	lsh_reader_init(&in);
+
 	// Run command loop.
-	lsh_loop();
+	lsh_loop(&in, interactive);
 
 	// Perform any shutdown/cleanup.
+	free(in.buf);
 	return EXIT_SUCCESS;
 }